@@ -51,6 +51,7 @@ namespace rt{
 		ray.direction = image_point - position;
 		ray.direction.normalize();
 		ray.origin = position;
+		ray.precompute();
 
 		return ray;
 	}
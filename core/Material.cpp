@@ -8,9 +8,9 @@
 #include <string.h>
 #include <iostream>
 #include <cmath>
+#include <chrono>
+#include <algorithm>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image/stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image/stb_image_write.h"
 
@@ -55,6 +55,9 @@ namespace rt{
         if (material.HasMember("tHeight")) {
             this->tHeight = material.GetObject()["tHeight"].GetInt();
         }
+        if (material.HasMember("tSRGB")) {
+            this->tSRGB = material.GetObject()["tSRGB"].GetBool();
+        }
         if (material.HasMember("diffusecolor")) {
             Vec3f diffusecolor(0.0, 0.0, 0.0);
             auto arr = material.GetObject()["diffusecolor"].GetArray();
@@ -69,51 +72,63 @@ namespace rt{
     };
 
     /**
-     * Setter function that sets the texture image information based on image specifications
+     * Texture getter for the lookups: requests the texture from the cache on first use, then waits for its
+     * decode or, with FALLBACK_DECODE, only checks whether it is done
+     *
+     * @return the decoded texture, null if not ready or if it cannot be decoded
      *
      */
-    void Material::setTextureMap()
-    {       
-        int width, height, channels;
-        this->textureImg = stbi_load(this->tPath.c_str(), &width, &height, &channels, 0);
-        this->channels = channels;
+    const Texture* Material::readyTexture()
+    {
+        if (this->texture || this->tPath.empty())
+            return this->texture.get();
+        if (!this->pendingTexture)
+            this->pendingTexture = TextureCache::request(this->tPath, this->tSRGB, TILED_LAYOUT, this->format);
+        if (this->decode == FALLBACK_DECODE &&
+            this->pendingTexture->wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return nullptr;
+        this->texture = this->pendingTexture->get();
+        return this->texture.get();
     }
 
     /**
-     * Mapping function
+     * Mapping function: trilinear sample of the texture, bilinear at a whole level
      *
      * @param pos UV coordinates
+     * @param lod mip level, fractional
      *
      * @return texture mapped linear RGB color based on UV coordinates
      *
      */
-    Vec3f Material::mapLookup(Vec2f pos)
+    Vec3f Material::mapLookup(Vec2f pos, float lod)
+    {
+        float rgba[4];
+        this->texture->trilinear(lod, pos.x, pos.y, rgba);
+        return Vec3f(rgba[0], rgba[1], rgba[2]);
+    }
+
+    /**
+     * Mip level selection: the level where the longer of the two footprint axes spans one texel
+     *
+     * @param dUVdx UV change to the next pixel in x
+     * @param dUVdy UV change to the next pixel in y
+     *
+     * @return mip level, fractional, 0 without a texture
+     *
+     */
+    float Material::mipLod(const Vec2f& dUVdx, const Vec2f& dUVdy) const
     {
-        Vec3f result;
-        
-        float u1 = pos.x - (float)floor(pos.x);
-        float v1 = pos.y - (float)floor(pos.y);
-
-        // scale u and v to the texture image of width and height
-        //int u = u1 * this->tWidth;
-        //int v = v1 * this->tHeight;
-        u1*= this->tWidth-1;
-        v1*= this->tHeight-1;
-
-        unsigned bytePerPixel = this->channels;
-        /*unsigned char* pixelOffset = this->textureImg + ((int)u1 + this->tWidth * (int)v1) * bytePerPixel;*/
-        unsigned char* pixelOffset = this->textureImg + ((int)u1 + this->tWidth * (int)v1) * bytePerPixel;
-        unsigned char r = pixelOffset[0];
-        unsigned char g = pixelOffset[1];
-        unsigned char b = pixelOffset[2];
-        unsigned char a = this->channels >= 4 ? pixelOffset[3] : 0xff;
-
-        result.x = (r > 255) ? 1.0: r / 255.0f;
-        result.y = (g > 255) ? 1.0 : g / 255.0f;
-        result.z = (b > 255) ? 1.0 : b / 255.0f;
-
-        
-        return result;
+        if (!this->texture)
+            return 0;
+        float width = (float)this->texture->getWidth(), height = (float)this->texture->getHeight();
+        float x2 = dUVdx.x * width * dUVdx.x * width + dUVdx.y * height * dUVdx.y * height;
+        float y2 = dUVdy.x * width * dUVdy.x * width + dUVdy.y * height * dUVdy.y * height;
+        float texels2 = std::max(x2, y2);
+        if (!(texels2 > 1))
+            return 0;
+
+        // log2 of the footprint in texels
+        return std::min(0.5f * std::log2(texels2), (float)(this->texture->getLevels() - 1));
     }
 
     /**
@@ -126,13 +141,32 @@ namespace rt{
      */
     Vec3f Material::getColor(Vec2f pos) {
         Vec3f col = this->diffusecolor;
-        if (this->textureImg)
+        if (readyTexture())
         {
             col = mapLookup(pos);
         }
         return col;
     }
 
+    /**
+     * Getter function for a lookup with a footprint
+     *
+     * @param pos UV coordinates
+     * @param dUVdx UV change to the next pixel in x
+     * @param dUVdy UV change to the next pixel in y
+     *
+     * @return final linear RGB color on hitpoint, from the mip level of the footprint
+     *
+     */
+    Vec3f Material::getColor(Vec2f pos, const Vec2f& dUVdx, const Vec2f& dUVdy) {
+        Vec3f col = this->diffusecolor;
+        if (readyTexture())
+        {
+            col = mapLookup(pos, mipLod(dUVdx, dUVdy));
+        }
+        return col;
+    }
+
 
 } //namespace rt
 
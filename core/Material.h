@@ -6,15 +6,25 @@
 #ifndef MATERIAL_H_
 #define MATERIAL_H_
 
+#include <memory>
 #include <string>
 #include "rapidjson/document.h"
 #include "math/geometry.h"
+#include "core/Texture.h"
 
 
 using namespace rapidjson;
 
 namespace rt{
 
+/*
+ * What a lookup does while the texture it needs is still being decoded
+ */
+enum TextureDecode {
+	STALL_DECODE,		// waits for the texture, so images do not depend on decode timing
+	FALLBACK_DECODE		// shades with the diffuse color until the texture is ready
+};
+
 class Material{
 public:
 	//
@@ -29,20 +39,40 @@ public:
 	virtual ~Material() {};
 
 	//
-	// setter function : sets texture image
+	// setter function : sets what lookups do while the texture decodes; the texture is requested from the
+	// texture cache by the first lookup, so textures no ray reaches are never decoded
+	//
+	void setTextureDecode(TextureDecode decode) {
+		this->decode = decode;
+	}
+
+	//
+	// setter function : sets the in-memory format the texture is decoded to
 	//
-	void setTextureMap();
+	void setTextureFormat(TextureFormat format) {
+		this->format = format;
+	}
 
 	//
-	// mapping function : returns the mapped coordinates from the UV coordinates for texture mapping
+	// mapping function : returns the filtered texture color at the UV coordinates and mip level, for texture mapping
 	//
-	Vec3f mapLookup(Vec2f pos);
+	Vec3f mapLookup(Vec2f pos, float lod = 0);
 
 	//
-	// color function : returns the final color
+	// mip level function : returns the fractional level whose texels match a footprint given by the UV derivatives
+	//
+	float mipLod(const Vec2f& dUVdx, const Vec2f& dUVdy) const;
+
+	//
+	// color function : returns the final color, from the full resolution texture
 	//
 	Vec3f getColor(Vec2f pos);
 
+	//
+	// color function : returns the final color, from the mip level matching the footprint of the lookup
+	//
+	Vec3f getColor(Vec2f pos, const Vec2f& dUVdx, const Vec2f& dUVdy);
+
 
 	//
 	// Getters
@@ -62,9 +92,12 @@ public:
 	Vec3f getDiffusecolor() const {
 		return diffusecolor;
 	}
-	std::string getTPath() const {
+	const std::string& getTPath() const {
 		return tPath;
 	}
+	bool getTSRGB() const {
+		return tSRGB;
+	}
 	int getTWidth() const {
 		return tWidth;
 	}
@@ -74,8 +107,8 @@ public:
 	int getType() const {
 		return type;
 	}
-	unsigned char* getTextureImg() const {
-		return textureImg;
+	const Texture* getTexture() const {
+		return texture.get();
 	}
 
 
@@ -86,12 +119,20 @@ private:
 	int specularexponent;
 	Vec3f diffusecolor;
 	std::string tPath;
+	bool tSRGB = false;		// texture colors are sRGB encoded, decoded to linear at load
 	int tWidth;
 	int tHeight;
 	int type;
 
-	unsigned char* textureImg;
-	int channels;
+	TextureDecode decode = STALL_DECODE;
+	TextureFormat format = FLOAT_FORMAT;
+	std::shared_ptr<const TextureFuture> pendingTexture;	// requested by the first lookup
+	std::shared_ptr<const Texture> texture;					// set once decoded
+
+	//
+	// the texture, requesting it on first use; null while it decodes (FALLBACK_DECODE) or if it cannot be decoded
+	//
+	const Texture* readyTexture();
 };
 
 
@@ -17,28 +17,88 @@ enum RayType {PRIMARY, SECONDARY, SHADOW};
 
 struct Ray{
 
-	RayType raytype;
+	Ray() {}
+	Ray(const Vec3f& origin, const Vec3f& direction, RayType raytype = PRIMARY) :
+		raytype(raytype), direction(direction), origin(origin) {
+		precompute();
+	}
+
+	//
+	// caches the reciprocal direction and its signs for the box slab tests, call again after changing direction
+	//
+	void precompute() {
+		invDirection = Vec3f(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+		dirIsNeg[0] = invDirection.x < 0;
+		dirIsNeg[1] = invDirection.y < 0;
+		dirIsNeg[2] = invDirection.z < 0;
+	}
+
+	RayType raytype = PRIMARY;
 
 	//---------- Ray variables ------
 	Vec3f direction;
 	Vec3f origin;
-	
+
+	//---------- derived from direction by precompute() ------
+	Vec3f invDirection;
+	int dirIsNeg[3];
+
 };
 
+/*
+ * Ray differentials: the rays through the next pixel in x and in y, traced along with a ray to measure its
+ * footprint on the surfaces it hits, for texture filtering.
+ * Source: Igehy, "Tracing Ray Differentials", SIGGRAPH 1999
+ */
+struct RayDifferential{
+
+	RayDifferential() : valid(false) {}
+	RayDifferential(const Vec3f& rxOrigin, const Vec3f& rxDirection, const Vec3f& ryOrigin, const Vec3f& ryDirection) :
+		valid(true), rxOrigin(rxOrigin), rxDirection(rxDirection), ryOrigin(ryOrigin), ryDirection(ryDirection) {}
+
+	//
+	// differentials of the mirror reflection at point p with unit normal n, starting at reflectedOrigin:
+	// the offset rays meet the tangent plane at p and reflect about n, so the surface is taken as flat there
+	//
+	RayDifferential reflect(const Vec3f& p, const Vec3f& n, const Vec3f& reflectedOrigin) const {
+		float dx = rxDirection.dotProduct(n), dy = ryDirection.dotProduct(n);
+		if (!valid || dx == 0 || dy == 0)
+			return RayDifferential();
+		Vec3f px = rxOrigin + rxDirection * (n.dotProduct(p - rxOrigin) / dx);
+		Vec3f py = ryOrigin + ryDirection * (n.dotProduct(p - ryOrigin) / dy);
+		return RayDifferential(reflectedOrigin + (px - p), rxDirection - n * (2 * dx),
+			reflectedOrigin + (py - p), ryDirection - n * (2 * dy));
+	}
 
-struct Hit{
+	bool valid;
+	Vec3f rxOrigin;
+	Vec3f rxDirection;
+	Vec3f ryOrigin;
+	Vec3f ryDirection;
+};
 
-	Vec3f point; //point where ray hits a shape
+
+class Shape;
+
+/*
+ * Hit record. The intersection tests only fill the first group; the surface attributes are filled once,
+ * for the closest hit, by Shape::fill_hit of the shape that was hit
+ */
+struct Hit{
 
 	//----------Hit variables ------
-	float distance;
-	bool hittable;
+	float distance = 0;
+	bool hittable = false;
+	const Shape* object = nullptr;	// shape that was hit
+	float u = 0, v = 0;				// barycentrics of the hit in a triangle
+	uint32_t triIndex = 0;			// triangle of a mesh, or half of a plane (0 lower, 1 upper)
+
+	//----------surface attributes (the vectors start at zero) ------
+	Vec3f point; //point where ray hits a shape
 	Vec3f normal;
-	std::string shape;
-	bool front_face;
-	Material* material;
+	bool front_face = false;
+	Material* material = nullptr;
 	Vec2f uv;
-	uint32_t triIndex;
 
 
 	inline void set_face_normal(const Ray& r, const Vec3f& outward_normal) {
@@ -10,6 +10,11 @@
 #include "lights/PointLight.h"
 #include "materials/BlinnPhong.h"
 #include "core/RayHitStructs.h"
+#include "core/Texture.h"
+#include "shapes/BVHCache.h"
+#include "shapes/CompressedBVH.h"
+#include "shapes/SphereBatch.h"
+#include "shapes/UniformGrid.h"
 
 #define _USE_MATH_DEFINES  // for MSVC, for M_PI
 #include <math.h>
@@ -19,6 +24,8 @@
 #include <stdlib.h>
 #include <numeric> 
 #include <limits>
+#include <memory>
+#include <ctime>
 
 namespace rt{
 
@@ -37,37 +44,100 @@ namespace rt{
     }
 
     /**
-     * Trace function
+     * Trace function: closest hit of the ray over all objects, in a single pass
      *
-     * @param orig ray arigin
-     * @param dir ray direction 
+     * @param ray the ray
      * @param objects shape objects in a vector
-     * @param shadowDistance shadow distance to be computed for shadow ray 
-     * @param rayType ray type to determine {PRIMARY, SECONDART, SHADOW}
-     * @return closest shape object if ray hits, otherwise nullptr
+     * @param maxDistance max distance of the hit
+     * @param rec hit record, with its surface attributes filled for the closest hit
+     *
+     * @return true if the ray hits an object within maxDistance
      *
      */
-    Shape* RayTracer::trace(const Vec3f& orig, const Vec3f& dir, std::vector<Shape*> objects, float shadowDistance, RayType rayType)
+    bool RayTracer::trace(const Ray& ray, const std::vector<Shape*>& objects, float maxDistance, Hit& rec)
     {
-        Hit hitShape;   
-        Shape* closestObject = nullptr;
-        float minDist = std::numeric_limits<float>::max();
-        for (uint32_t k = 0; k < objects.size(); ++k) {            
-            Ray ray;
-            ray.origin = orig;
-            ray.direction = dir;
-            hitShape = objects.at(k)->intersect(ray); 
-
-            if(hitShape.hittable && hitShape.distance < shadowDistance){ 
-                // skip if ray is shadow ray
-                if (rayType == SHADOW ) continue;
-                if (hitShape.distance < minDist) {
-                    minDist = hitShape.distance;
-                    closestObject = objects.at(k);
-                 }                
+        bool hit_anything = false;
+        float closest = maxDistance;
+        for (const Shape* object : objects) {
+            if (object->hit(ray, 0, closest, rec)) {
+                hit_anything = true;
+                closest = rec.distance;
             }
         }
-        return closestObject;
+
+        if (!hit_anything)
+            return false;
+        rec.hittable = true;
+        rec.object->fill_hit(ray, rec);
+        return true;
+    }
+
+    /**
+     * Occlusion function for shadow rays: stops at the first occluder
+     *
+     * @param ray the shadow ray
+     * @param objects shape objects in a vector
+     * @param maxDistance distance to the light
+     *
+     * @return true if any object hits the ray within maxDistance
+     *
+     */
+    bool RayTracer::occluded(const Ray& ray, const std::vector<Shape*>& objects, float maxDistance)
+    {
+        for (const Shape* object : objects) {
+            if (object->occluded(ray, 0, maxDistance))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Texture footprint of a hit: the offset rays of the differential are tested against the shape that was hit,
+     * and the UV changes between their hits and this one approximate the UV derivatives per pixel. An offset
+     * ray that misses the shape, or lands on another face of a mesh or plane (UVs are per face there), gives
+     * no estimate, and the other axis stands in for it.
+     *
+     * @param rec hit record with its surface attributes
+     * @param differential differentials of the ray that hit
+     * @param dUVdx UV change to the next pixel in x
+     * @param dUVdy UV change to the next pixel in y
+     *
+     * @return false if neither offset ray gives an estimate
+     *
+     */
+    bool RayTracer::textureFootprint(const Hit& rec, const RayDifferential& differential, Vec2f& dUVdx, Vec2f& dUVdy)
+    {
+        if (!differential.valid)
+            return false;
+
+        const Vec3f* origins[2] = { &differential.rxOrigin, &differential.ryOrigin };
+        const Vec3f* directions[2] = { &differential.rxDirection, &differential.ryDirection };
+        Vec2f* derivatives[2] = { &dUVdx, &dUVdy };
+        bool found[2];
+
+        // planes and meshes record the face of a hit in triIndex, spheres and triangles leave it unset
+        PrimitiveKind kind = rec.object->getKind();
+        bool faces = kind != SPHERE_PRIMITIVE && kind != TRIANGLE_PRIMITIVE;
+        for (int a = 0; a < 2; a++) {
+            Ray offset(*origins[a], *directions[a]);
+            Hit h;
+            found[a] = rec.object->hit(offset, 0, std::numeric_limits<float>::max(), h) && (!faces || h.triIndex == rec.triIndex);
+            if (!found[a])
+                continue;
+            rec.object->fill_hit(offset, h);
+
+            // lookups wrap, so take the shorter way around
+            float du = h.uv.x - rec.uv.x, dv = h.uv.y - rec.uv.y;
+            *derivatives[a] = Vec2f(du - std::floor(du + 0.5f), dv - std::floor(dv + 0.5f));
+        }
+
+        if (!found[0] && !found[1])
+            return false;
+        if (!found[0])
+            dUVdx = dUVdy;
+        if (!found[1])
+            dUVdy = dUVdx;
+        return true;
     }
 
     /**
@@ -75,6 +145,7 @@ namespace rt{
      *
      * @param orig ray arigin
      * @param dir ray direction
+     * @param differential ray differentials for texture filtering, invalid for none
      * @param objects shape objects in a vector
      * @param light light source
      * @param maxDepth the max number of bounce
@@ -83,40 +154,44 @@ namespace rt{
      * @return final color in linear RGB value
      *
      */
-    Vec3f RayTracer::castRay( const Vec3f& orig, const Vec3f& dir, const std::vector<Shape*>& objects, LightSource* light, uint32_t maxDepth, uint32_t depth)
+    Vec3f RayTracer::castRay( const Vec3f& orig, const Vec3f& dir, const RayDifferential& differential, const std::vector<Shape*>& objects,
+        LightSource* light, uint32_t maxDepth, uint32_t depth)
     {
         if (depth > maxDepth) {
             return Vec3f(0.01, 0.01, 0.01);
         }
         
         Vec3f hitColor = Vec3f(0.01, 0.01, 0.01); // background color
-        Shape* hitObject = trace(orig, dir, objects, std::numeric_limits<float>::max(), PRIMARY);
+        Ray ray(orig, dir, depth == 0 ? PRIMARY : SECONDARY);
+        Hit hitShape;
 
         // if ray hits an object, compute reflected colors
-        if (hitObject != nullptr) {
-            Ray ray;
-            ray.origin = orig;
-            ray.direction = dir;
-            Hit hitShape = hitObject->intersect(ray);
+        if (trace(ray, objects, std::numeric_limits<float>::max(), hitShape)) {
 
             // retrieve object specs and compute prelim settings
             Vec3f hitPoint = hitShape.point;
             Vec3f N = hitShape.normal;    
-            Material* material = hitObject->getMaterial();
+            Material* material = hitShape.material;
             hitColor = material->getDiffusecolor();
             //Vec3f lightDir = (hitShape.point - light->position).normalize();
             float bias = 1e-4;                
             Vec3f lightIntensity = light->getLightIntensity(hitShape.point, light->position);                
 
-            // compute shadow and light elements   
+            // compute shadow and light elements: the shading takes hitPoint, which the shapes store as a unit
+            // vector, while the shadow ray starts from the world position of the hit, nudged towards the light
             Vec3f lightDir, intensity;
             float shadowDistance;
             light->illuminate(hitPoint, lightDir, intensity, shadowDistance);
-            bool isVisible = trace(hitPoint+N*bias , -lightDir, objects, shadowDistance, SHADOW) == nullptr;
+            Vec3f surfacePoint = orig + dir * hitShape.distance, shadowDir;
+            light->illuminate(surfacePoint, shadowDir, intensity, shadowDistance);
+            Ray shadowRay(surfacePoint - shadowDir * bias, -shadowDir, SHADOW);
+            bool isVisible = !occluded(shadowRay, objects, shadowDistance);
 
-            // texture mapping
+            // texture mapping, from the mip level of the ray footprint
+            Vec2f dUVdx, dUVdy;
             if(!material->getTPath().empty()){
-                hitColor = material->getColor(hitObject->getUV(hitShape));
+                hitColor = textureFootprint(hitShape, differential, dUVdx, dUVdy) ?
+                    material->getColor(hitShape.uv, dUVdx, dUVdy) : material->getColor(hitShape.uv);
             }
 
             // compute diffuse and specular reflections
@@ -125,11 +200,12 @@ namespace rt{
             
 
             // add if material needs perfect reflections
-            if(hitObject->getMaterial()->getKr() < 1)
+            if(material->getKr() < 1)
             {
                 Vec3f reflectionDirection = (dir) - 2 * (dir).dotProduct(N) * N;
                 Vec3f reflectionRayOrig = (reflectionDirection.dotProduct(N) < 0) ? hitPoint + N : hitPoint - N;
-                hitColor = hitColor + castRay(reflectionRayOrig, reflectionDirection, objects, light, maxDepth, depth + 1) *hitObject->getMaterial()->getKr();
+                RayDifferential reflected = differential.reflect(orig + dir * hitShape.distance, N, reflectionRayOrig);
+                hitColor = hitColor + castRay(reflectionRayOrig, reflectionDirection, reflected, objects, light, maxDepth, depth + 1) * material->getKr();
             }
         }
         return hitColor;
@@ -140,14 +216,17 @@ namespace rt{
      *
      * @param orig ray arigin
      * @param dir ray direction
+     * @param differential ray differentials for texture filtering, invalid for none
      * @param world root node of the shape objects nodes
      * @param light light source
      * @param depth the max number of bounce
+     * @param rayType PRIMARY for camera rays, SECONDARY for reflections
      *
      * @return final color in linear RGB value
      *
      */
-    Vec3f RayTracer::ray_color(const Vec3f& orig, const Vec3f& dir, const Shape* world, LightSource* light, int depth) {
+    Vec3f RayTracer::ray_color(const Vec3f& orig, const Vec3f& dir, const RayDifferential& differential, const Shape* world,
+        LightSource* light, int depth, RayType rayType) {
         Hit hitShape;
         Vec3f hitColor = Vec3f(0.01, 0.01, 0.01); // background color
 
@@ -156,30 +235,39 @@ namespace rt{
             return hitColor;
 
         // if ray hits nothing, return the background color
-        Ray ray;
-        ray.origin = orig;
-        ray.direction = dir;
+        Ray ray(orig, dir, rayType);
         if (!world->hit(ray, 0.001, std::numeric_limits<float>::max(), hitShape))
             return Vec3f(0.01, 0.01, 0.01);
+        hitShape.object->fill_hit(ray, hitShape);
         
         // retrieve object specs and compute prelim settings
         Vec3f hitPoint = hitShape.point;
         Material* material = hitShape.material;
         hitColor = material->getDiffusecolor(); // Vec3f(1,1,1);
-        Vec3f lightDir = (hitShape.point - light->position).normalize();
         float bias = 1e-4;
         Vec3f N = hitShape.normal;
         Vec3f lightIntensity = light->getLightIntensity(hitPoint, light->position);
 
+        // compute shadow and light elements with an any-hit query towards the light, from the world position
+        // of the hit nudged towards the light (hitPoint is the unit vector the shading takes)
+        Vec3f lightDir, intensity;
+        float shadowDistance;
+        light->illuminate(hitPoint, lightDir, intensity, shadowDistance);
+        Vec3f surfacePoint = orig + dir * hitShape.distance, shadowDir;
+        light->illuminate(surfacePoint, shadowDir, intensity, shadowDistance);
+        Ray shadowRay(surfacePoint - shadowDir * bias, -shadowDir, SHADOW);
+        bool isVisible = !world->occluded(shadowRay, 0, shadowDistance);
+
 
-        // texture mapping        
+        // texture mapping, from the mip level of the ray footprint
+        Vec2f dUVdx, dUVdy;
         if (!material->getTPath().empty()) {
-            hitColor = material->getColor(hitShape.uv);
+            hitColor = textureFootprint(hitShape, differential, dUVdx, dUVdy) ?
+                material->getColor(hitShape.uv, dUVdx, dUVdy) : material->getColor(hitShape.uv);
         }
 
         // compute diffuse and specular reflections
         BlinnPhong* blinnPhong;
-        bool isVisible = false;
         hitColor = blinnPhong->getReflectedColor(dir, hitShape, material, lightIntensity, hitColor, lightDir, isVisible);
 
         
@@ -188,7 +276,8 @@ namespace rt{
         {            
             Vec3f reflectionDirection = (dir)-2 * (dir).dotProduct(N) * N;
             Vec3f reflectionRayOrig = (reflectionDirection.dotProduct(N) < 0) ? hitPoint + N : hitPoint - N;
-            hitColor = hitColor + ray_color(reflectionRayOrig, reflectionDirection, world, light, depth-1) * material->getKr();
+            RayDifferential reflected = differential.reflect(orig + dir * hitShape.distance, N, reflectionRayOrig);
+            hitColor = hitColor + ray_color(reflectionRayOrig, reflectionDirection, reflected, world, light, depth-1, SECONDARY) * material->getKr();
         }
         
         return hitColor;
@@ -198,7 +287,8 @@ namespace rt{
 /**
  * Performs ray tracing to render a photorealistic scene.
  * Support normal ray tracer (BASELINE) and BVH optimized ray tracer. Note that BVH version does not support TriMesh.
- * Comment out the lines 227, 253, and 256 appropriately to switch the version. 
+ * The BVH version is used when the scene specifies "accelerator": {"type": "bvh"}, optionally with a "cache" file
+ * that stores the built tree between runs. "accelerator": {"type": "grid"} uses a uniform grid instead.
  *
  * @param camera the camera viewing the scene
  * @param scene the scene to render, including objects and lightsources
@@ -215,16 +305,49 @@ Vec3f* RayTracer::render(Camera* camera, Scene* scene, int nbounces){
 
     std::vector<Shape*> shapes = scene->getShapes();    
 
-    // set texture map if available
-    for (int i = 0; i < shapes.size(); ++i) {
-        Shape* shape = shapes.at(i);
-        if (!shape->getMaterial()->getTPath().empty()) {
-            shape->getMaterial()->setTextureMap();
+    // textures are decoded in the background, on the first lookup into them
+
+    // create BVH tree and nodes, or map them from the cache file; the arena frees the nodes after rendering
+    Shape* BVHShapes = nullptr;
+    BVHArena BVHNodes;
+    SphereBatches sphereBatches;
+    std::unique_ptr<CompressedBVH> compressed;
+    std::unique_ptr<BVHStats> BVHTreeStats;
+    if (scene->getAccelerator() == std::string("bvh") && !shapes.empty()) {
+        BVH* tree = BVHCache::buildOrLoad(shapes, scene->getBVHSettings(), scene->getBVHCachePath(), BVHNodes);
+        BVHShapes = tree;
+
+        // measure the tree before it is compressed, and count the traversal work of the render
+        if (!scene->getBVHStatsPath().empty()) {
+            BVHTreeStats.reset(new BVHStats(BVHStats::measure(tree)));
+            BVHCounters::enable();
+        }
+
+        // test the spheres of each leaf 8 at a time
+        sphereBatches.batch(tree, BVHNodes);
+        if (sphereBatches.size() > 0)
+            printf("Sphere batches: %zu\n", sphereBatches.size());
+
+        // quantize the tree and drop the full-size nodes
+        if (scene->getBVHSettings().compressed) {
+            compressed.reset(new CompressedBVH(tree));
+            std::size_t numNodes = compressed->nodeBytes() / sizeof(QuantizedNode);
+            printf("Compressed BVH: %zu nodes, %zu KB (was %zu KB)\n", numNodes,
+                compressed->nodeBytes() / 1024, numNodes * sizeof(BVH) / 1024);
+            BVHNodes.clear();
+            BVHShapes = compressed.get();
         }
     }
 
-    // create BVH tree and nodes
-    //Shape* BVHShapes = new BVH(shapes, 0, shapes.size(), 0, 0); // <--- comment this out for BVH
+    // or bin the shapes into a uniform grid
+    std::unique_ptr<UniformGrid> grid;
+    if (scene->getAccelerator() == std::string("grid") && !shapes.empty()) {
+        clock_t timeStart = clock();
+        grid.reset(new UniformGrid(shapes));
+        printf("Grid build time: %04.2f (ms), %dx%dx%d cells, %zu references\n", 1000.0f * (clock() - timeStart) / CLOCKS_PER_SEC,
+            grid->getResolution(0), grid->getResolution(1), grid->getResolution(2), grid->getReferenceCount());
+        BVHShapes = grid.get();
+    }
 
     // lightsource
     std::vector<LightSource*> lightSources = scene->getLightSources();
@@ -247,18 +370,41 @@ Vec3f* RayTracer::render(Camera* camera, Scene* scene, int nbounces){
             // cast without camera 
             ray.direction = Vec3f(x, y, -1.0f);
             ray.direction.normalize();
-            ray.origin = camera->getPosition();            
-                        
-            // BASELINE ray tracer: Use example.json to run this code
-            Vec3f color = castRay(ray.origin, ray.direction, shapes, light, nbounces, 0); // <--- comment out when use BVH
+            ray.origin = camera->getPosition();
+            ray.precompute();
 
-            // BVH ray tracer: Use example_bvh.json or example_bvh_test.json if run this code. BVH does not support TriMesh
-            //Vec3f color = ray_color(ray.origin, ray.direction, BVHShapes, light, nbounces);
+            // rays through the next pixel in x and y, for the texture footprints
+            Vec3f rxDirection = Vec3f(x + 2.0f / camera->getHeight(), y, -1.0f).normalize();
+            Vec3f ryDirection = Vec3f(x, y + 2.0f / camera->getWidth(), -1.0f).normalize();
+            RayDifferential differential(ray.origin, rxDirection, ray.origin, ryDirection);
+                        
+            Vec3f color;
+            if (BVHShapes != nullptr) {
+                // BVH ray tracer: Use example_bvh.json or example_bvh_test.json if run this code. BVH does not support TriMesh
+                color = ray_color(ray.origin, ray.direction, differential, BVHShapes, light, nbounces);
+            }
+            else {
+                // BASELINE ray tracer: Use example.json to run this code
+                color = castRay(ray.origin, ray.direction, differential, shapes, light, nbounces, 0);
+            }
 
             pixelbuffer[camera->getHeight() * i + j] = color *255.0;
         }
     }   
 
+    if (TextureCache::decodeCount() > 0)
+        printf("Textures decoded: %zu (%.1f MB)\n", TextureCache::decodeCount(),
+            TextureCache::decodedBytes() / (1024.0 * 1024.0));
+
+    // BVH report, with the traversal counts of the render
+    if (BVHTreeStats) {
+        BVHCounters::disable();
+        if (BVHTreeStats->save(scene->getBVHStatsPath()))
+            printf("BVH stats written to %s\n", scene->getBVHStatsPath().c_str());
+        else
+            std::cerr << "Could not write BVH stats " << scene->getBVHStatsPath() << std::endl;
+    }
+
 	return pixelbuffer;
 
 }
@@ -49,21 +49,33 @@ public:
     //
     // ray casting function (baseline) : returns the final color
     //
-    static Vec3f castRay(const Vec3f& orig, const Vec3f& dir, const std::vector<Shape*>& objects, LightSource* light, uint32_t maxDepth, uint32_t depth);
+    static Vec3f castRay(const Vec3f& orig, const Vec3f& dir, const RayDifferential& differential, const std::vector<Shape*>& objects,
+        LightSource* light, uint32_t maxDepth, uint32_t depth);
     
     //
-    // trace function : returns the closest hit shape
+    // trace function : returns true and the full hit record of the closest hit, in one pass over the objects
     //
-    static Shape* trace(const Vec3f& orig, const Vec3f& dir, std::vector<Shape*> objects, float shadowDistance, RayType rayType);
+    static bool trace(const Ray& ray, const std::vector<Shape*>& objects, float maxDistance, Hit& rec);
+
+    //
+    // occlusion function : returns true if any object hits the shadow ray within maxDistance
+    //
+    static bool occluded(const Ray& ray, const std::vector<Shape*>& objects, float maxDistance);
   
     //
     // ray casting function (BVH) : returns the final color
     //
-    static Vec3f ray_color(const Vec3f& orig, const Vec3f& dir, const Shape* world, LightSource* light, int depth);
+    static Vec3f ray_color(const Vec3f& orig, const Vec3f& dir, const RayDifferential& differential, const Shape* world,
+        LightSource* light, int depth, RayType rayType = PRIMARY);
         
 
 private:
 
+    //
+    // footprint function : returns true and the UV change to the next pixel in x and y at a hit, if known
+    //
+    static bool textureFootprint(const Hit& rec, const RayDifferential& differential, Vec2f& dUVdx, Vec2f& dUVdy);
+
 
 };
 
@@ -24,12 +24,54 @@ void Scene::createScene(Value& scenespecs){
 
 	//----------parse json object to populate scene-----------
 
+    // optional acceleration structure specs
+    if (scenespecs.HasMember("accelerator")) {
+        Value& accel = scenespecs["accelerator"];
+        if (accel.HasMember("type")) {
+            this->accelerator = accel["type"].GetString();
+        }
+        if (accel.HasMember("cache")) {
+            this->bvhCachePath = accel["cache"].GetString();
+        }
+        if (accel.HasMember("builder")) {
+            this->bvhSettings.builder = accel["builder"].GetString();
+        }
+        if (accel.HasMember("splitBudget")) {
+            this->bvhSettings.splitBudget = accel["splitBudget"].GetFloat();
+        }
+        if (accel.HasMember("maxLeafSize")) {
+            this->bvhSettings.maxLeafSize = accel["maxLeafSize"].GetInt();
+        }
+        if (accel.HasMember("treeletPasses")) {
+            this->bvhSettings.treeletPasses = accel["treeletPasses"].GetInt();
+        }
+        if (accel.HasMember("compressed")) {
+            this->bvhSettings.compressed = accel["compressed"].GetBool();
+        }
+        if (accel.HasMember("stats")) {
+            this->bvhStatsPath = accel["stats"].GetString();
+        }
+    }
+
+    // optional texture specs: "stall" (default) or "fallback" to the diffuse color while a texture decodes,
+    // and the in-memory format, "float" (default) or "bc1" blocks, 32 times smaller
+    if (scenespecs.HasMember("textures")) {
+        Value& textures = scenespecs["textures"];
+        if (textures.HasMember("decode")) {
+            this->textureDecode = textures["decode"].GetString() == std::string("fallback") ? FALLBACK_DECODE : STALL_DECODE;
+        }
+        if (textures.HasMember("format")) {
+            this->textureFormat = textures["format"].GetString() == std::string("bc1") ? BC1_FORMAT : FLOAT_FORMAT;
+        }
+    }
+
     Value& shapes = scenespecs["shapes"];   
     
+    // kind and array index of every shape, in scene order
+    std::vector<std::pair<PrimitiveKind, std::size_t>> order;
 
     // Retrieve shapes and push back them    
     for (SizeType i = 0; i < shapes.Size(); i++) {
-        Shape* shape;
         Material* material;
         std::string type = shapes[i].GetObject()["type"].GetString();
 
@@ -44,9 +86,11 @@ void Scene::createScene(Value& scenespecs){
                 center.z = arr[2].GetFloat();
             }
             
-            material = new Material(shapes[i]["material"], 1, std::string("none"));
+            materials.emplace_back(new Material(shapes[i]["material"], 1, std::string("none")));
+            material = materials.back().get();
 
-            shape = new Sphere(center, radius, type, material);
+            order.push_back(std::make_pair(SPHERE_PRIMITIVE, spheres.size()));
+            spheres.push_back(Sphere(center, radius, type, material));
         }
         // create plane 
         else if (type == std::string("plane")) {
@@ -80,8 +124,10 @@ void Scene::createScene(Value& scenespecs){
                 v3.y = arr[1].GetFloat();
                 v3.z = arr[2].GetFloat();
             }
-            material = new Material(shapes[i]["material"], 2, id);
-            shape = new Plane(v0, v1, v2, v3, id, material);
+            materials.emplace_back(new Material(shapes[i]["material"], 2, id));
+            material = materials.back().get();
+            order.push_back(std::make_pair(PLANE_PRIMITIVE, planes.size()));
+            planes.push_back(Plane(v0, v1, v2, v3, id, material));
             
         }
         // create triangle 
@@ -109,13 +155,16 @@ void Scene::createScene(Value& scenespecs){
                 v2.y = arr[1].GetFloat();
                 v2.z = arr[2].GetFloat();
             }
-            material = new Material(shapes[i]["material"], 4, id);
-            shape = new Triangle(v0, v1, v2, id, material);
+            materials.emplace_back(new Material(shapes[i]["material"], 4, id));
+            material = materials.back().get();
+            order.push_back(std::make_pair(TRIANGLE_PRIMITIVE, triangles.size()));
+            triangles.push_back(Triangle(v0, v1, v2, id, material));
         }
         // create triangle mesh
         else if (type == std::string("trimesh")) {
             std::string id = shapes[i].GetObject()["id"].GetString();
-            material = new Material(shapes[i]["material"], 4, id);
+            materials.emplace_back(new Material(shapes[i]["material"], 4, id));
+            material = materials.back().get();
 
             // mesh specs
             float scale = shapes[i].GetObject()["scale"].GetFloat();
@@ -127,16 +176,29 @@ void Scene::createScene(Value& scenespecs){
             //manually create a poly sphere
             for (uint32_t i = 0; i < n; ++i) {
                 int divs = 5 + i;
-                Shape* mesh = generatePolyShphere(2, divs, scale, locX, locY, locZ, material);
-                this->shapes.push_back(mesh);
+                order.push_back(std::make_pair(GENERIC_PRIMITIVE, meshes.size()));
+                meshes.emplace_back(generatePolyShphere(2, divs, scale, locX, locY, locZ, material));
             }
 
             //shape = loadMesh("../meshes/cow.geo", material);
             //if (shape == nullptr) continue;
         }
+    }
 
-        this->shapes.push_back(shape);
-    }       
+    for (const std::unique_ptr<Material>& material : materials) {
+        material->setTextureDecode(textureDecode);
+        material->setTextureFormat(textureFormat);
+    }
+
+    // point at the shapes once their arrays are complete
+    for (const auto& entry : order) {
+        switch (entry.first) {
+        case SPHERE_PRIMITIVE: this->shapes.push_back(&spheres[entry.second]); break;
+        case TRIANGLE_PRIMITIVE: this->shapes.push_back(&triangles[entry.second]); break;
+        case PLANE_PRIMITIVE: this->shapes.push_back(&planes[entry.second]); break;
+        default: this->shapes.push_back(meshes[entry.second].get()); break;
+        }
+    }
 
 
     Value& lightsources = scenespecs["lightsources"];
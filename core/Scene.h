@@ -6,6 +6,7 @@
 #ifndef SCENE_H_
 #define SCENE_H_
 
+#include <memory>
 #include <vector>
 #include <iostream>
 #include <fstream>
@@ -23,6 +24,7 @@
 #include "shapes/Triangle.h"
 #include "shapes/Plane.h"
 #include "shapes/Sphere.h"
+#include "shapes/BVH.h"
 #include "lights/PointLight.h"
 
 using namespace rapidjson;
@@ -67,10 +69,41 @@ public:
 		return lightSources;
 	}
 
+	std::string getAccelerator() const {
+		return accelerator;
+	}
+
+	std::string getBVHCachePath() const {
+		return bvhCachePath;
+	}
+
+	BVHSettings getBVHSettings() const {
+		return bvhSettings;
+	}
+
+	std::string getBVHStatsPath() const {
+		return bvhStatsPath;
+	}
+
 private:
 
+	std::string accelerator = "none"; // "none" (brute force), "bvh" or "grid"
+	std::string bvhCachePath;         // BVH cache file, empty to rebuild every run
+	BVHSettings bvhSettings;
+	std::string bvhStatsPath;         // BVH statistics report (JSON), empty for none
+	TextureDecode textureDecode = STALL_DECODE;
+	TextureFormat textureFormat = FLOAT_FORMAT;
+
 	std::vector<LightSource*> lightSources;
-	std::vector<Shape*> shapes;
+	std::vector<Shape*> shapes;       // scene order, pointing into the arrays below
+
+	// the shapes by type, each type stored contiguously
+	std::vector<Sphere> spheres;
+	std::vector<Triangle> triangles;
+	std::vector<Plane> planes;
+	std::vector<std::unique_ptr<TriMesh>> meshes;  // generated on the heap, freed with the scene
+
+	std::vector<std::unique_ptr<Material>> materials;  // one per scene shape, freeing them releases their textures
 };
 
 } //namespace rt
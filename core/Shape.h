@@ -19,6 +19,7 @@
 #include <memory>
 
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <array>
 
@@ -40,18 +41,34 @@ namespace rt{
         Vec3f min() const { return minimum; }
         Vec3f max() const { return maximum; }
 
-        bool hit(const Ray& r, double t_min, double t_max) const {
-            for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((minimum[a] - r.origin[a]) / r.direction[a],
-                    (maximum[a] - r.origin[a]) / r.direction[a]);
-                auto t1 = fmax((minimum[a] - r.origin[a]) / r.direction[a],
-                    (maximum[a] - r.origin[a]) / r.direction[a]);
-                t_min = fmax(t0, t_min);
-                t_max = fmin(t1, t_max);
-                if (t_max <= t_min)
-                    return false;
-            }
-            return true;
+        bool hit(const Ray& r, float t_min, float t_max) const {
+            float t_entry;
+            return hit(r, t_min, t_max, t_entry);
+        }
+
+        /**
+         * Slab test on the ray's precomputed reciprocal direction, also returning the entry distance.
+         * The direction signs pick the near and far plane of each slab, so there are no divisions or swaps.
+         * The min/max are ordered so a NaN slab distance (0 * inf when the origin lies on a slab plane)
+         * keeps the current range instead of poisoning it.
+         */
+        bool hit(const Ray& r, float t_min, float t_max, float& t_entry) const {
+            float tx0 = ((r.dirIsNeg[0] ? maximum.x : minimum.x) - r.origin.x) * r.invDirection.x;
+            float tx1 = ((r.dirIsNeg[0] ? minimum.x : maximum.x) - r.origin.x) * r.invDirection.x;
+            float ty0 = ((r.dirIsNeg[1] ? maximum.y : minimum.y) - r.origin.y) * r.invDirection.y;
+            float ty1 = ((r.dirIsNeg[1] ? minimum.y : maximum.y) - r.origin.y) * r.invDirection.y;
+            float tz0 = ((r.dirIsNeg[2] ? maximum.z : minimum.z) - r.origin.z) * r.invDirection.z;
+            float tz1 = ((r.dirIsNeg[2] ? minimum.z : maximum.z) - r.origin.z) * r.invDirection.z;
+
+            t_min = tx0 > t_min ? tx0 : t_min;
+            t_min = ty0 > t_min ? ty0 : t_min;
+            t_min = tz0 > t_min ? tz0 : t_min;
+            t_max = tx1 < t_max ? tx1 : t_max;
+            t_max = ty1 < t_max ? ty1 : t_max;
+            t_max = tz1 < t_max ? tz1 : t_max;
+
+            t_entry = t_min;
+            return t_min <= t_max;
         }
 
         double area() const {
@@ -61,6 +78,30 @@ namespace rt{
             return 2 * (a * b + b * c + c * a);
         }
 
+        //
+        // Helpers for the builders: an empty box grows to the points and boxes added to it
+        //
+        static aabb empty() {
+            float inf = std::numeric_limits<float>::infinity();
+            return aabb(Vec3f(inf, inf, inf), Vec3f(-inf, -inf, -inf));
+        }
+
+        bool is_empty() const {
+            return minimum.x > maximum.x || minimum.y > maximum.y || minimum.z > maximum.z;
+        }
+
+        void expand(const Vec3f& p) {
+            minimum = Vec3f(fmin(minimum.x, p.x), fmin(minimum.y, p.y), fmin(minimum.z, p.z));
+            maximum = Vec3f(fmax(maximum.x, p.x), fmax(maximum.y, p.y), fmax(maximum.z, p.z));
+        }
+
+        void expand(const aabb& b) {
+            if (b.is_empty())
+                return;
+            expand(b.minimum);
+            expand(b.maximum);
+        }
+
         int longest_axis() const {
             auto a = maximum.x - minimum.x;
             auto b = maximum.y - minimum.y;
@@ -91,6 +132,53 @@ namespace rt{
         return aabb(small, big);
     }
 
+    inline aabb intersect_boxes(const aabb& box0, const aabb& box1) {
+        return aabb(Vec3f(fmax(box0.minimum.x, box1.minimum.x), fmax(box0.minimum.y, box1.minimum.y), fmax(box0.minimum.z, box1.minimum.z)),
+            Vec3f(fmin(box0.maximum.x, box1.maximum.x), fmin(box0.maximum.y, box1.maximum.y), fmin(box0.maximum.z, box1.maximum.z)));
+    }
+
+    /*
+     * Bounds of the parts of a convex polygon below and above the plane p[axis] = pos.
+     * Used by the spatial split builder to clip primitive references.
+     */
+    inline void split_polygon_box(const Vec3f* v, int n, int axis, float pos, aabb& left_box, aabb& right_box) {
+        left_box = aabb::empty();
+        right_box = aabb::empty();
+        for (int i = 0; i < n; i++) {
+            const Vec3f& p0 = v[i];
+            const Vec3f& p1 = v[(i + 1) % n];
+            if (p0[axis] <= pos)
+                left_box.expand(p0);
+            if (p0[axis] >= pos)
+                right_box.expand(p0);
+
+            // edge crosses the plane: the crossing point bounds both sides
+            if ((p0[axis] < pos && p1[axis] > pos) || (p0[axis] > pos && p1[axis] < pos)) {
+                float t = (pos - p0[axis]) / (p1[axis] - p0[axis]);
+                Vec3f p = p0 + (p1 - p0) * t;
+                p[axis] = pos;
+                left_box.expand(p);
+                right_box.expand(p);
+            }
+        }
+    }
+
+    //
+    // FNV-1a hashing of raw bytes into h, for the keys of data cached from the shapes
+    //
+    inline void hash_bytes(uint64_t& h, const void* data, std::size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (std::size_t i = 0; i < size; ++i) {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+    }
+
+/*
+ * Kinds of shapes the accelerators test without a virtual call (see PrimitiveRef)
+ */
+enum PrimitiveKind {GENERIC_PRIMITIVE, SPHERE_PRIMITIVE, TRIANGLE_PRIMITIVE, PLANE_PRIMITIVE, SPHERE_BATCH_PRIMITIVE, PRIMITIVE_KINDS};
+
 class Shape{
 public:
 
@@ -115,6 +203,51 @@ public:
 	virtual bool hit(const Ray& r, double t_min, double t_max, Hit& rec) const = 0;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
 
+	//
+	// Occlusion (any hit) test for shadow rays: returns true if the ray hits the shape within [t_min, t_max].
+	// Subclasses override it to skip the hit record bookkeeping
+	//
+	virtual bool occluded(const Ray& r, double t_min, double t_max) const {
+		Hit rec;
+		return hit(r, t_min, t_max, rec);
+	}
+
+	//
+	// Surface attributes (point, normal, UV and material) of a hit this shape reported from hit(), computed once
+	// for the closest hit of a ray rather than for every candidate. Shapes whose hit() fills them leave it empty
+	//
+	virtual void fill_hit(const Ray&, Hit&) const {}
+
+	//
+	// Bounds of the parts of the shape below and above the plane p[axis] = pos (spatial split builder).
+	// The default cuts the bounding box; polygons override it with exact clipping
+	//
+	virtual void split_bounding_box(int axis, float pos, aabb& left_box, aabb& right_box) const {
+		aabb box;
+		bounding_box(0, 0, box);
+		left_box = right_box = box;
+		left_box.maximum[axis] = fmin(box.maximum[axis], pos);
+		right_box.minimum[axis] = fmax(box.minimum[axis], pos);
+	}
+
+	//
+	// Adds the geometry the accelerators are built from to the hash h, for the BVH cache key.
+	// The default hashes the bounding box; shapes override it with their exact geometry
+	//
+	virtual void hash(uint64_t& h) const {
+		aabb box;
+		bounding_box(0, 0, box);
+		hash_bytes(h, &box.minimum, sizeof(Vec3f));
+		hash_bytes(h, &box.maximum, sizeof(Vec3f));
+	}
+
+	//
+	// Kind of the shape for the accelerators' dispatch, GENERIC_PRIMITIVE for shapes tested through the vtable
+	//
+	virtual PrimitiveKind getKind() const {
+		return GENERIC_PRIMITIVE;
+	}
+
 	//
 	// Getter
 	//
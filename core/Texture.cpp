@@ -0,0 +1,555 @@
+/*
+ * Texture.cpp
+ *
+ */
+
+#include "core/Texture.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image/stb_image.h"
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb_image/stb_image_resize.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+
+namespace rt{
+
+namespace {
+
+#ifdef __AVX2__
+    /*
+     * Bilinear blend of four RGBA texels, one register each: above left, above right, below left, below right
+     */
+    inline __m128 blend(const float* const quad[4], float fx, float fy) {
+        __m128 wx = _mm_set1_ps(fx), wy = _mm_set1_ps(fy);
+        __m128 a = _mm_loadu_ps(quad[0]), b = _mm_loadu_ps(quad[1]);
+        __m128 c = _mm_loadu_ps(quad[2]), d = _mm_loadu_ps(quad[3]);
+        __m128 top = _mm_fmadd_ps(wx, _mm_sub_ps(b, a), a);
+        __m128 bottom = _mm_fmadd_ps(wx, _mm_sub_ps(d, c), c);
+        return _mm_fmadd_ps(wy, _mm_sub_ps(bottom, top), top);
+    }
+#else
+    inline void blend(const float* const quad[4], float fx, float fy, float rgba[4]) {
+        for (int c = 0; c < 4; c++) {
+            float top = quad[0][c] + fx * (quad[1][c] - quad[0][c]);
+            float bottom = quad[2][c] + fx * (quad[3][c] - quad[2][c]);
+            rgba[c] = top + fy * (bottom - top);
+        }
+    }
+#endif
+
+    // the linear value of every 8-bit color value, for linear or for sRGB encoded colors
+    const float* linearTable(bool sRGB) {
+        struct Tables {
+            float linear[256], srgb[256];
+            Tables() {
+                for (int i = 0; i < 256; i++) {
+                    float c = i / 255.0f;
+                    linear[i] = c;
+                    srgb[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+                }
+            }
+        };
+        static const Tables tables;
+        return sRGB ? tables.srgb : tables.linear;
+    }
+
+    // a linear color value back to 8 bits, sRGB encoded if asked
+    unsigned char encodeChannel(float value, bool sRGB) {
+        float c = std::min(std::max(value, 0.0f), 1.0f);
+        if (sRGB)
+            c = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+        return (unsigned char)(c * 255 + 0.5f);
+    }
+
+    std::uint16_t pack565(const int rgb[3]) {
+        return (std::uint16_t)(((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | (rgb[2] * 31 + 127) / 255);
+    }
+
+    void unpack565(std::uint16_t color, int rgb[3]) {
+        int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+        rgb[0] = r << 3 | r >> 2;
+        rgb[1] = g << 2 | g >> 4;
+        rgb[2] = b << 3 | b >> 2;
+    }
+
+    // the four colors of a BC1 block: the two endpoints and two in between, or their mean and black
+    void blockPalette(std::uint16_t c0, std::uint16_t c1, int colors[4][3]) {
+        unpack565(c0, colors[0]);
+        unpack565(c1, colors[1]);
+        for (int c = 0; c < 3; c++) {
+            int a = colors[0][c], b = colors[1][c];
+            colors[2][c] = c0 > c1 ? (2 * a + b) / 3 : (a + b) / 2;
+            colors[3][c] = c0 > c1 ? (a + 2 * b) / 3 : 0;
+        }
+    }
+
+    /*
+     * Encodes 4x4 RGB texels, row-major, to a BC1 block. The endpoints span the bounding box of the colors,
+     * along the diagonal the colors follow and inset by a sixteenth; each texel takes the nearest of the four
+     * block colors.
+     */
+    std::uint64_t encodeBlock(const unsigned char texels[16][3]) {
+        int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 }, mean[3] = { 0, 0, 0 };
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], (int)texels[i][c]);
+                hi[c] = std::max(hi[c], (int)texels[i][c]);
+                mean[c] += texels[i][c];
+            }
+
+        // against the channel of widest range, channels that fall while it rises run the other way
+        int reference = 0;
+        for (int c = 1; c < 3; c++)
+            if (hi[c] - lo[c] > hi[reference] - lo[reference])
+                reference = c;
+        for (int c = 0; c < 3; c++) {
+            int covariance = 0;
+            for (int i = 0; i < 16; i++)
+                covariance += (16 * texels[i][reference] - mean[reference]) * (16 * texels[i][c] - mean[c]) / 256;
+            if (covariance < 0)
+                std::swap(lo[c], hi[c]);
+            int inset = (hi[c] - lo[c]) / 16;
+            lo[c] += inset;
+            hi[c] -= inset;
+        }
+
+        std::uint16_t c0 = pack565(hi), c1 = pack565(lo);
+        if (c0 < c1)
+            std::swap(c0, c1);
+        std::uint32_t indices = 0;
+        if (c0 != c1) {
+            int colors[4][3];
+            blockPalette(c0, c1, colors);
+            for (int i = 0; i < 16; i++) {
+                int best = 0, bestDistance = 1 << 30;
+                for (int k = 0; k < 4; k++) {
+                    int distance = 0;
+                    for (int c = 0; c < 3; c++)
+                        distance += (texels[i][c] - colors[k][c]) * (texels[i][c] - colors[k][c]);
+                    if (distance < bestDistance) {
+                        best = k;
+                        bestDistance = distance;
+                    }
+                }
+                indices |= (std::uint32_t)best << (2 * i);
+            }
+        }
+        return c0 | (std::uint64_t)c1 << 16 | (std::uint64_t)indices << 32;
+    }
+
+    // a BC1 block to 4x4 float RGBA texels, row-major, converting the colors through a linear table
+    void decodeBlock(std::uint64_t block, const float table[256], float rgba[16 * 4]) {
+        int colors[4][3];
+        blockPalette((std::uint16_t)block, (std::uint16_t)(block >> 16), colors);
+        float palette[4][4];
+        for (int k = 0; k < 4; k++) {
+            for (int c = 0; c < 3; c++)
+                palette[k][c] = table[colors[k][c]];
+            palette[k][3] = 1.0f;
+        }
+        std::uint32_t indices = (std::uint32_t)(block >> 32);
+        for (int i = 0; i < 16; i++)
+            std::copy(palette[(indices >> (2 * i)) & 3], palette[(indices >> (2 * i)) & 3] + 4, rgba + 4 * i);
+    }
+
+    /*
+     * Decoded BC1 block in the block cache of a thread
+     */
+    struct DecodedBlock {
+        std::uint64_t key;      // texture, level and block; 0 for an empty slot
+        float rgba[16 * 4];     // the texels, row-major
+    };
+
+    // direct-mapped on the block position, so the blocks of a neighbourhood of 8x8 blocks share no slot
+    const int BLOCK_CACHE_SIZE = 64;
+    thread_local DecodedBlock blockCache[BLOCK_CACHE_SIZE];
+
+    // texture ids start at 1, so no block key is 0
+    std::atomic<std::uint32_t> textureIds(1);
+
+    /*
+     * Threads that run the texture decodes in the order they are queued. Jobs still queued at exit are run
+     * before the threads stop, so no request is left without its texture.
+     */
+    class DecodePool {
+
+    public:
+
+        DecodePool() : stopping(false)
+        {
+            unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+            for (unsigned t = 0; t < threads; t++)
+                workers.emplace_back([this]() { work(); });
+        }
+
+        ~DecodePool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& worker : workers)
+                worker.join();
+        }
+
+        void submit(std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+            wake.notify_one();
+        }
+
+    private:
+
+        void work()
+        {
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                    if (jobs.empty())
+                        return;
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> jobs;
+        std::vector<std::thread> workers;
+        bool stopping;
+    };
+
+    // started on the first request, so scenes without textures start no threads
+    DecodePool& decodePool() {
+        static DecodePool pool;
+        return pool;
+    }
+
+} // namespace
+
+    std::mutex TextureCache::mutex;
+    std::map<TextureCache::Key, std::weak_ptr<const TextureFuture>> TextureCache::textures;
+    std::atomic<std::size_t> TextureCache::decodes(0);
+    std::atomic<std::size_t> TextureCache::bytes(0);
+
+    /**
+     * Constructor that converts the pixels to linear float RGBA, builds the mip pyramid, each level resized
+     * from the one above it, and stores every level in the layout, or encodes it to BC1 blocks
+     *
+     * @param pixels row-major 8-bit pixels, copied
+     * @param width image width
+     * @param height image height
+     * @param channels channels per pixel: gray, gray and alpha, RGB or RGBA
+     * @param sRGB true if the pixels are sRGB encoded, to decode them to linear values
+     * @param layout memory layout of the levels
+     * @param format in-memory format of the levels
+     *
+     */
+    Texture::Texture(const unsigned char* pixels, int width, int height, int channels, bool sRGB, TextureLayout layout,
+        TextureFormat format) :
+        layout(layout), format(format), sRGB(sRGB), id(textureIds++)
+    {
+        // level sizes first, so the pyramid is one allocation
+        std::size_t size = 0;
+        Level level = { 0, width, height, 0 };
+        while (true) {
+            level.offset = size;
+            if (format == BC1_FORMAT) {
+                level.tilesX = (level.width + 3) >> 2;
+                size += (std::size_t)level.tilesX * ((level.height + 3) >> 2);
+            }
+            else {
+                level.tilesX = (level.width + TILE_SIZE - 1) >> TILE_SHIFT;
+                std::size_t texelCount = layout == TILED_LAYOUT ?
+                    (std::size_t)level.tilesX * ((level.height + TILE_SIZE - 1) >> TILE_SHIFT) << (2 * TILE_SHIFT) :
+                    (std::size_t)level.width * level.height;
+                size += texelCount * 4;
+            }
+            levels.push_back(level);
+            if (level.width == 1 && level.height == 1)
+                break;
+            level.width = std::max(level.width / 2, 1);
+            level.height = std::max(level.height / 2, 1);
+        }
+        if (format == BC1_FORMAT)
+            blocks.assign(size, 0);
+        else
+            texels.assign(size, 0.0f);
+
+        // alpha is always linear
+        const float* linear = linearTable(sRGB);
+        std::size_t pixelCount = (std::size_t)width * height;
+        std::vector<float> above(pixelCount * 4), current;
+        for (std::size_t i = 0; i < pixelCount; i++) {
+            const unsigned char* pixel = pixels + i * channels;
+            bool gray = channels < 3, alpha = channels == 2 || channels == 4;
+            above[4 * i] = linear[pixel[0]];
+            above[4 * i + 1] = linear[pixel[gray ? 0 : 1]];
+            above[4 * i + 2] = linear[pixel[gray ? 0 : 2]];
+            above[4 * i + 3] = alpha ? pixel[channels - 1] / 255.0f : 1.0f;
+        }
+
+        // resize row-major, then copy the rows of each level into its layout
+        for (std::size_t l = 0; l < levels.size(); l++) {
+            const Level& target = levels[l];
+            if (l > 0) {
+                current.resize((std::size_t)target.width * target.height * 4);
+                stbir_resize_float(above.data(), levels[l - 1].width, levels[l - 1].height, 0,
+                    current.data(), target.width, target.height, 0, 4);
+                above.swap(current);
+            }
+            if (format == BC1_FORMAT) {
+                encodeLevel((int)l, above.data());
+                continue;
+            }
+            for (int y = 0; y < target.height; y++) {
+                const float* row = above.data() + (std::size_t)y * target.width * 4;
+
+                // a whole row, or the row of one tile at a time
+                int run = layout == TILED_LAYOUT ? TILE_SIZE : target.width;
+                for (int x = 0; x < target.width; x += run) {
+                    int count = std::min(run, target.width - x);
+                    std::copy(row + (std::size_t)x * 4, row + (std::size_t)(x + count) * 4,
+                        texels.begin() + texelOffset((int)l, x, y));
+                }
+            }
+        }
+    }
+
+    /**
+     * Encodes a level to BC1 blocks, repeating the last row and column into the blocks past the edges
+     *
+     * @param level mip level
+     * @param rgba the level, row-major linear float RGBA
+     *
+     */
+    void Texture::encodeLevel(int level, const float* rgba)
+    {
+        const Level& l = levels[level];
+        unsigned char block[16][3];
+        for (int by = 0; by < (l.height + 3) >> 2; by++) {
+            for (int bx = 0; bx < l.tilesX; bx++) {
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(4 * bx + (i & 3), l.width - 1), y = std::min(4 * by + (i >> 2), l.height - 1);
+                    const float* pixel = rgba + ((std::size_t)y * l.width + x) * 4;
+                    for (int c = 0; c < 3; c++)
+                        block[i][c] = encodeChannel(pixel[c], sRGB);
+                }
+                blocks[l.offset + (std::size_t)by * l.tilesX + bx] = encodeBlock(block);
+            }
+        }
+    }
+
+    /**
+     * Texel of a BC1 level, from the block cache of the calling thread, decoding its block on a miss
+     *
+     * @param level mip level
+     * @param x column
+     * @param y row
+     *
+     * @return the texel, valid until a lookup of the thread evicts its block
+     */
+    const float* Texture::blockTexel(int level, int x, int y) const
+    {
+        const Level& l = levels[level];
+        int bx = x >> 2, by = y >> 2;
+        std::uint64_t key = (std::uint64_t)(id & 0xffffff) << 40 | (std::uint64_t)level << 34 | (std::uint64_t)by << 17 | bx;
+        DecodedBlock& slot = blockCache[(((by & 7) << 3) | (bx & 7)) ^ (level & (BLOCK_CACHE_SIZE - 1))];
+        if (slot.key != key) {
+            decodeBlock(blocks[l.offset + (std::size_t)by * l.tilesX + bx], linearTable(sRGB), slot.rgba);
+            slot.key = key;
+        }
+        return slot.rgba + (((y & 3) << 2) | (x & 3)) * 4;
+    }
+
+    /**
+     * Finds the four texels around texture coordinates (u, v) in a level, repeating the texture
+     *
+     * @param level mip level
+     * @param u horizontal texture coordinate
+     * @param v vertical texture coordinate, 0 at the top row
+     * @param quad the texels above left, above right, below left and below right
+     * @param copies room for copies of the texels, for BC1 texels, which a later lookup may evict
+     * @param fx weight of the right texels
+     * @param fy weight of the lower texels
+     *
+     */
+    void Texture::corners(int level, float u, float v, const float* quad[4], float copies[16], float& fx, float& fy) const
+    {
+        const Level& l = levels[level];
+
+        // texel centers are at half-integer coordinates
+        float x = (u - std::floor(u)) * l.width - 0.5f;
+        float y = (v - std::floor(v)) * l.height - 0.5f;
+        float left = std::floor(x), top = std::floor(y);
+        fx = x - left;
+        fy = y - top;
+
+        int x0 = (int)left, y0 = (int)top, x1 = x0 + 1, y1 = y0 + 1;
+        if (x0 < 0) x0 += l.width;
+        if (y0 < 0) y0 += l.height;
+        if (x1 >= l.width) x1 -= l.width;
+        if (y1 >= l.height) y1 -= l.height;
+        const int xs[4] = { x0, x1, x0, x1 }, ys[4] = { y0, y0, y1, y1 };
+        for (int i = 0; i < 4; i++) {
+            quad[i] = texel(level, xs[i], ys[i]);
+
+            // a BC1 texel is copied out as it is read: at a wrapped edge, the block of another corner can evict it
+            if (format == BC1_FORMAT)
+                quad[i] = std::copy(quad[i], quad[i] + 4, copies + 4 * i) - 4;
+        }
+    }
+
+    /**
+     * Bilinear sample of a level: the four texels around (u, v), blended by their distances
+     *
+     * @param level mip level
+     * @param u horizontal texture coordinate
+     * @param v vertical texture coordinate, 0 at the top row
+     * @param rgba the filtered color
+     *
+     */
+    void Texture::bilinear(int level, float u, float v, float rgba[4]) const
+    {
+        const float* quad[4];
+        float copies[16], fx, fy;
+        corners(level, u, v, quad, copies, fx, fy);
+#ifdef __AVX2__
+        _mm_storeu_ps(rgba, blend(quad, fx, fy));
+#else
+        blend(quad, fx, fy, rgba);
+#endif
+    }
+
+    /**
+     * Trilinear sample: bilinear samples of the levels below and above lod, blended by the fraction of lod
+     *
+     * @param lod mip level, fractional, clamped to the levels of the texture
+     * @param u horizontal texture coordinate
+     * @param v vertical texture coordinate, 0 at the top row
+     * @param rgba the filtered color
+     *
+     */
+    void Texture::trilinear(float lod, float u, float v, float rgba[4]) const
+    {
+        lod = std::min(std::max(lod, 0.0f), (float)(levels.size() - 1));
+        int level = (int)lod;
+        float f = lod - level;
+        if (f == 0) {
+            bilinear(level, u, v, rgba);
+            return;
+        }
+
+        const float* fine[4];
+        const float* coarse[4];
+        float fineCopies[16], coarseCopies[16], fx0, fy0, fx1, fy1;
+        corners(level, u, v, fine, fineCopies, fx0, fy0);
+        corners(level + 1, u, v, coarse, coarseCopies, fx1, fy1);
+#ifdef __AVX2__
+        __m128 a = blend(fine, fx0, fy0), b = blend(coarse, fx1, fy1);
+        _mm_storeu_ps(rgba, _mm_fmadd_ps(_mm_set1_ps(f), _mm_sub_ps(b, a), a));
+#else
+        float a[4], b[4];
+        blend(fine, fx0, fy0, a);
+        blend(coarse, fx1, fy1, b);
+        for (int c = 0; c < 4; c++)
+            rgba[c] = a[c] + f * (b[c] - a[c]);
+#endif
+    }
+
+    /**
+     * Finds the texture of a file in the cache, or queues its decode
+     *
+     * @param path texture file path
+     * @param sRGB true if the file is sRGB encoded
+     * @param layout memory layout of the texture
+     * @param format in-memory format of the texture
+     *
+     * @return the shared future of the texture
+     */
+    std::shared_ptr<const TextureFuture> TextureCache::request(const std::string& path, bool sRGB, TextureLayout layout,
+        TextureFormat format)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Key key(path, sRGB, (int)layout, (int)format);
+        std::weak_ptr<const TextureFuture>& entry = textures[key];
+        std::shared_ptr<const TextureFuture> texture = entry.lock();
+        if (texture)
+            return texture;
+
+        // a new decode: drop the entries of the textures freed since, so the map only holds live ones
+        for (auto it = textures.begin(); it != textures.end();) {
+            if (it->second.expired() && it->first != key)
+                it = textures.erase(it);
+            else
+                ++it;
+        }
+
+        std::shared_ptr<std::promise<std::shared_ptr<const Texture>>> promise =
+            std::make_shared<std::promise<std::shared_ptr<const Texture>>>();
+        texture = std::make_shared<const TextureFuture>(promise->get_future().share());
+        entry = texture;
+        decodePool().submit([path, sRGB, layout, format, promise]() {
+            promise->set_value(decode(path, sRGB, layout, format));
+        });
+        return texture;
+    }
+
+    /**
+     * Decodes a texture file, on a thread of the pool
+     *
+     * @param path texture file path
+     * @param sRGB true if the file is sRGB encoded
+     * @param layout memory layout of the texture
+     * @param format in-memory format of the texture
+     *
+     * @return the texture, null if the file cannot be decoded
+     */
+    std::shared_ptr<const Texture> TextureCache::decode(const std::string& path, bool sRGB, TextureLayout layout,
+        TextureFormat format)
+    {
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 0);
+        if (pixels == nullptr)
+            return nullptr;
+        std::shared_ptr<const Texture> texture = std::make_shared<const Texture>(pixels, width, height, channels, sRGB,
+            layout, format);
+        stbi_image_free(pixels);
+        decodes++;
+        bytes += texture->getBytes();
+        return texture;
+    }
+
+    /**
+     * Number of files decoded, counting a file again when it was freed and loaded anew
+     */
+    std::size_t TextureCache::decodeCount()
+    {
+        return decodes;
+    }
+
+    /**
+     * Memory of the textures decoded, in bytes, the freed ones included
+     */
+    std::size_t TextureCache::decodedBytes()
+    {
+        return bytes;
+    }
+
+} //namespace rt
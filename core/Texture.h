@@ -0,0 +1,190 @@
+/*
+ * Texture.h
+ *
+ *
+ */
+
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace rt{
+
+/*
+ * Memory layout of the texels of a texture level
+ */
+enum TextureLayout {
+    ROW_MAJOR_LAYOUT,   // rows top to bottom
+    TILED_LAYOUT        // 8x8 texel tiles in row-major order, each tile row-major: a small footprint touches few cache lines
+};
+
+/*
+ * In-memory format of the texels of a texture
+ */
+enum TextureFormat {
+    FLOAT_FORMAT,       // linear float RGBA, 16 bytes a texel
+    BC1_FORMAT          // BC1 blocks of 4x4 texels in 8 bytes (two RGB565 colors and a 2-bit index per texel, no alpha),
+                        // decoded block by block on lookup through a small per-thread cache of decoded blocks
+};
+
+/*
+ * Decoded texture image, stored as linear float RGBA, with its mip pyramid: level l + 1 is level l resized to
+ * half its width and height (rounded down, at least 1), down to a single texel. The conversion from the 8-bit
+ * file, and the sRGB decode if asked for, happen once here, so a lookup only fetches and blends texels: one
+ * texel is 4 floats, one SIMD register. The levels are stored in the texture's layout, tiled unless asked
+ * otherwise, so lookups go through texel() or the samplers. Immutable once decoded, so any number of
+ * materials (and render threads) can share one.
+ * A BC1 texture keeps its levels block-compressed instead, 32 times smaller than float texels, and decodes
+ * the blocks it reads into a cache of the reading thread; the layout does not apply to it.
+ */
+class Texture {
+
+public:
+
+    static const int TILE_SHIFT = 3;    // tiles of 8x8 texels
+    static const int TILE_SIZE = 1 << TILE_SHIFT;
+
+    //
+    // Constructors : converts row-major 8-bit pixels (1 to 4 channels, gray or RGB with optional alpha) to
+    // linear float RGBA in the layout, decoding sRGB if asked, and builds the mip levels from them; or, in
+    // BC1_FORMAT, encodes the levels to blocks
+    //
+    Texture(const unsigned char* pixels, int width, int height, int channels, bool sRGB = false,
+        TextureLayout layout = TILED_LAYOUT, TextureFormat format = FLOAT_FORMAT);
+
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
+    //
+    // texel of a level at column x and row y: red, green, blue and alpha.
+    // A BC1 texel lives in the block cache of the thread, until another lookup of the thread evicts it
+    //
+    const float* texel(int level, int x, int y) const {
+        if (format == BC1_FORMAT)
+            return blockTexel(level, x, y);
+        return texels.data() + texelOffset(level, x, y);
+    }
+
+    //
+    // bilinear sample of a level at texture coordinates (u, v), repeating the texture outside [0, 1)
+    //
+    void bilinear(int level, float u, float v, float rgba[4]) const;
+
+    //
+    // trilinear sample: bilinear samples of the two levels around lod, blended
+    //
+    void trilinear(float lod, float u, float v, float rgba[4]) const;
+
+    //
+    // Getters, level 0 is the full resolution image
+    //
+    int getLevels() const {
+        return (int)levels.size();
+    }
+    int getWidth(int level = 0) const {
+        return levels[level].width;
+    }
+    int getHeight(int level = 0) const {
+        return levels[level].height;
+    }
+    TextureLayout getLayout() const {
+        return layout;
+    }
+    TextureFormat getFormat() const {
+        return format;
+    }
+    std::size_t getBytes() const {
+        return texels.size() * sizeof(float) + blocks.size() * sizeof(std::uint64_t);
+    }
+
+private:
+    struct Level {
+        std::size_t offset; // first float of the level in texels, or first block in blocks
+        int width;
+        int height;
+        int tilesX;         // tiles (or blocks) per row of tiles, partial tiles at the edges are padded
+    };
+
+    void corners(int level, float u, float v, const float* quad[4], float copies[16], float& fx, float& fy) const;
+    void encodeLevel(int level, const float* rgba);
+    const float* blockTexel(int level, int x, int y) const;
+
+    // float offset of a texel in texels
+    std::size_t texelOffset(int level, int x, int y) const {
+        const Level& l = levels[level];
+        std::size_t index;
+        if (layout == TILED_LAYOUT) {
+            std::size_t tile = (std::size_t)(y >> TILE_SHIFT) * l.tilesX + (x >> TILE_SHIFT);
+            index = (tile << (2 * TILE_SHIFT)) + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+        }
+        else {
+            index = (std::size_t)y * l.width + x;
+        }
+        return l.offset + index * 4;
+    }
+
+    std::vector<float> texels;          // all levels, one after the other
+    std::vector<std::uint64_t> blocks;  // or, in BC1_FORMAT, their blocks, each level row-major
+    std::vector<Level> levels;
+    TextureLayout layout;
+    TextureFormat format;
+    bool sRGB;
+    std::uint32_t id;                   // tells the textures apart in the block caches
+};
+
+//
+// a texture being decoded: its value is the texture, null if the file cannot be decoded
+//
+typedef std::shared_future<std::shared_ptr<const Texture>> TextureFuture;
+
+/*
+ * Process-wide cache of decoded textures, keyed by file path and decode options, so every texture file is
+ * decoded once however many materials use it. Decodes run on a background pool of threads: a request
+ * returns at once, with the future of the texture. The cache only holds weak references: a texture is freed
+ * with the last material that uses it, and decoded again if a later scene asks for it. The entries of freed
+ * textures are dropped at the next decode.
+ */
+class TextureCache {
+
+public:
+
+    //
+    // the texture of a file, queueing its decode on first request.
+    // sRGB tells whether the file stores sRGB encoded colors, to decode to linear ones
+    //
+    static std::shared_ptr<const TextureFuture> request(const std::string& path, bool sRGB = false,
+        TextureLayout layout = TILED_LAYOUT, TextureFormat format = FLOAT_FORMAT);
+
+    //
+    // number of decodes so far, and the memory of the textures they made
+    //
+    static std::size_t decodeCount();
+    static std::size_t decodedBytes();
+
+private:
+    typedef std::tuple<std::string, bool, int, int> Key;    // path and decode options (sRGB, layout and format)
+
+    static std::shared_ptr<const Texture> decode(const std::string& path, bool sRGB, TextureLayout layout,
+        TextureFormat format);
+
+    static std::mutex mutex;
+    static std::map<Key, std::weak_ptr<const TextureFuture>> textures;
+    static std::atomic<std::size_t> decodes;
+    static std::atomic<std::size_t> bytes;
+};
+
+} //namespace rt
+
+
+
+#endif /* TEXTURE_H_ */
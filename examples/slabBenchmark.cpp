@@ -0,0 +1,80 @@
+/*
+ * slabBenchmark.cpp
+ *
+ * Microbenchmark of the ray/box slab test run at every BVH node visit.
+ * Compares the original test (double arithmetic, two divisions per axis) with aabb::hit,
+ * which uses the ray's precomputed reciprocal direction in float.
+ *
+ * Usage: ./slabbenchmark [number of tests]
+ */
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "core/Shape.h"
+
+using namespace rt;
+
+//
+// The slab test as it was before rays carried their reciprocal direction
+//
+static bool legacySlabTest(const aabb& box, const Ray& r, double t_min, double t_max) {
+	for (int a = 0; a < 3; a++) {
+		auto t0 = fmin((box.minimum[a] - r.origin[a]) / r.direction[a],
+			(box.maximum[a] - r.origin[a]) / r.direction[a]);
+		auto t1 = fmax((box.minimum[a] - r.origin[a]) / r.direction[a],
+			(box.maximum[a] - r.origin[a]) / r.direction[a]);
+		t_min = fmax(t0, t_min);
+		t_max = fmin(t1, t_max);
+		if (t_max <= t_min)
+			return false;
+	}
+	return true;
+}
+
+static float randomFloat(float min, float max) {
+	return min + (max - min) * (rand() / (RAND_MAX + 1.0f));
+}
+
+int main(int argc, char* argv[]) {
+
+	std::size_t numTests = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000000;
+	const std::size_t numBoxes = 4096, numRays = 1024;
+
+	// random boxes and rays, both small enough to stay in cache so only the test itself is timed
+	srand(1);
+	std::vector<aabb> boxes(numBoxes);
+	for (aabb& box : boxes) {
+		Vec3f c(randomFloat(-5, 5), randomFloat(-5, 5), randomFloat(-5, 5));
+		Vec3f e(randomFloat(0.1f, 2), randomFloat(0.1f, 2), randomFloat(0.1f, 2));
+		box = aabb(c - e, c + e);
+	}
+	std::vector<Ray> rays(numRays);
+	for (Ray& ray : rays) {
+		Vec3f dir(randomFloat(-1, 1), randomFloat(-1, 1), randomFloat(-1, 1));
+		ray = Ray(Vec3f(randomFloat(-1, 1), randomFloat(-1, 1), 10), dir.normalize());
+	}
+
+	auto run = [&](const char* name, auto test) {
+		std::size_t hits = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (std::size_t i = 0; i < numTests; ++i) {
+			hits += test(boxes[i % numBoxes], rays[(i / numBoxes) % numRays]);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		double ns = std::chrono::duration<double, std::nano>(end - start).count() / numTests;
+		printf("%-28s %6.2f ns/test  (%zu hits)\n", name, ns, hits);
+	};
+
+	printf("Slab tests: %zu\n", numTests);
+	run("legacy (double, divisions)", [](const aabb& box, const Ray& r) {
+		return legacySlabTest(box, r, 0.001, std::numeric_limits<float>::max());
+	});
+	run("aabb::hit (float, 1/dir)", [](const aabb& box, const Ray& r) {
+		return box.hit(r, 0.001f, std::numeric_limits<float>::max());
+	});
+
+	return 0;
+}
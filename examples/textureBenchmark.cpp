@@ -0,0 +1,97 @@
+/*
+ * textureBenchmark.cpp
+ *
+ * Microbenchmark of texture lookups in the two texel layouts of Texture, row-major and 8x8 tiles, and in
+ * BC1 blocks decoded on lookup.
+ * A texture too large for the caches is read along four access patterns: along rows, down columns,
+ * in 8x8 patches at random places and angles (the lookups of a block of neighbouring pixels on a surface,
+ * one texel apart) and at random.
+ *
+ * Usage: ./texturebenchmark [texture size] [number of lookups]
+ */
+
+#define _USE_MATH_DEFINES  // for MSVC, for M_PI
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "core/Texture.h"
+
+using namespace rt;
+
+struct Coordinates {
+	int x, y;
+};
+
+static float randomFloat(float min, float max) {
+	return min + (max - min) * (rand() / (RAND_MAX + 1.0f));
+}
+
+int main(int argc, char* argv[]) {
+
+	int size = argc > 1 ? std::atoi(argv[1]) : 2048;
+	std::size_t numLookups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16000000;
+	const int channels = 3, patchSize = 8;
+
+	// random RGB texture, in both layouts and compressed
+	srand(1);
+	std::vector<unsigned char> pixels((std::size_t)size * size * channels);
+	for (unsigned char& p : pixels)
+		p = (unsigned char)(rand() & 0xff);
+	Texture rowMajor(pixels.data(), size, size, channels, false, ROW_MAJOR_LAYOUT);
+	Texture tiled(pixels.data(), size, size, channels, false, TILED_LAYOUT);
+	Texture compressed(pixels.data(), size, size, channels, false, TILED_LAYOUT, BC1_FORMAT);
+
+	// the texel coordinates of every pattern, computed up front so only the lookups are timed
+	std::vector<Coordinates> rows(numLookups), columns(numLookups), patches(numLookups), randoms(numLookups);
+	for (std::size_t i = 0; i < numLookups; ++i) {
+		std::size_t texel = i % ((std::size_t)size * size);
+		rows[i] = { (int)(texel % size), (int)(texel / size) };
+		columns[i] = { (int)(texel / size), (int)(texel % size) };
+		randoms[i] = { rand() % size, rand() % size };
+	}
+	for (std::size_t i = 0; i < numLookups; i += patchSize * patchSize) {
+		float x0 = randomFloat(0, (float)size), y0 = randomFloat(0, (float)size), angle = randomFloat(0, 2 * (float)M_PI);
+		float c = std::cos(angle), s = std::sin(angle);
+		for (std::size_t k = i; k < std::min(i + patchSize * patchSize, numLookups); ++k) {
+			int px = (int)(k - i) % patchSize, py = (int)(k - i) / patchSize;
+			int x = (int)std::floor(x0 + px * c - py * s), y = (int)std::floor(y0 + px * s + py * c);
+			patches[k] = { (x % size + size) % size, (y % size + size) % size };
+		}
+	}
+
+	// every lookup waits for the one before, through a mask that is zero at run time but unknown to the compiler,
+	// as in the renderer where a lookup follows the traversal of its ray: the time is the latency of the lookups
+	volatile int zero = 0;
+	int mask = zero;
+	auto run = [&](const char* name, const Texture& texture, const std::vector<Coordinates>& pattern) {
+		double sum = 0;
+		int previous = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (const Coordinates& c : pattern) {
+			const float* texel = texture.texel(0, c.x ^ (previous & mask), c.y);
+			previous = (int)texel[0];
+			sum += texel[0] + texel[1] + texel[2];
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		double ns = std::chrono::duration<double, std::nano>(end - start).count() / pattern.size();
+		printf("%-24s %6.2f ns/lookup  (sum %.1f)\n", name, ns, sum);
+	};
+
+	printf("Texture: %dx%d, lookups: %zu, %.1f MB float, %.1f MB BC1\n", size, size, numLookups,
+		tiled.getBytes() / (1024.0 * 1024.0), compressed.getBytes() / (1024.0 * 1024.0));
+	const char* patterns[] = { "rows", "columns", "patches", "random" };
+	const std::vector<Coordinates>* coordinates[] = { &rows, &columns, &patches, &randoms };
+	for (int p = 0; p < 4; p++) {
+		std::string name(patterns[p]);
+		run((name + ", row-major").c_str(), rowMajor, *coordinates[p]);
+		run((name + ", tiled").c_str(), tiled, *coordinates[p]);
+		run((name + ", bc1").c_str(), compressed, *coordinates[p]);
+	}
+
+	return 0;
+}
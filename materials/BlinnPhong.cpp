@@ -24,7 +24,7 @@ namespace rt{
       * @return color with reflections and refractions using Blinn-Phong model
       *
       */
-    Vec3f BlinnPhong::getReflectedColor(Vec3f rayDirection, Hit hit, Material* material, Vec3f lightIntensity, Vec3f color, Vec3f lightDirection, bool isVisible) {
+    Vec3f BlinnPhong::getReflectedColor(Vec3f rayDirection, const Hit& hit, Material* material, Vec3f lightIntensity, Vec3f color, Vec3f lightDirection, bool isVisible) {
         float ior = 1.3;
         Vec3f refractionColor = 0, reflectionColor = 0;        
 
@@ -27,7 +27,7 @@ public:
 	//
 	// Math functions for reflections and refractions 
 	//
-	Vec3f getReflectedColor(Vec3f rayDirection, Hit hitPoint, Material* material, Vec3f lightIntensity, Vec3f color, Vec3f lightDirection, bool isVisible);
+	Vec3f getReflectedColor(Vec3f rayDirection, const Hit& hitPoint, Material* material, Vec3f lightIntensity, Vec3f color, Vec3f lightDirection, bool isVisible);
 
 	float clamp(const float& lo, const float& hi, const float& v);
 
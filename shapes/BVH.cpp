@@ -4,59 +4,131 @@
  *
  */
 #include "BVH.h"
+#include "SBVH.h"
+#include "TreeletOptimizer.h"
+#include <cstdint>
 
 
 namespace rt{
 
-    /**
-     * Factory function that returns BVH node subclass based on shapes specifications
+namespace {
+
+    // random integer in [0, 2], the split axis of a median node
+    int random_axis() {
+        return static_cast<int>(3 * (rand() / (RAND_MAX + 1.0)));
+    }
+
+    /*
+     * Median split builder over a permutation of the shape indices
      * Source: https://raytracing.github.io/books/RayTracingTheNextWeek.html
      *
-     * @return BVH node subclass instance
-     *
+     * Each node sorts its range of the permutation in place along a random axis and gives each half to a
+     * child, so the shapes are never copied and the nodes come from the arena in depth-first order.
+     * A half of at most maxLeafSize shapes becomes a leaf when the SAH finds that cheaper.
      */
-    BVH::BVH(std::vector<Shape*> src_objects, std::size_t start, std::size_t end, double time0, double time1)
-    {
-        auto objects = src_objects; // Create a modifiable array of the source scene objects
+    class MedianBuilder {
+    public:
+        MedianBuilder(const std::vector<Shape*>& shapes, int maxLeafSize) :
+            shapes(shapes), boxes(shapes.size()), indices(shapes.size()), maxLeafSize(maxLeafSize) {
+            for (std::size_t i = 0; i < shapes.size(); ++i) {
+                if (!shapes[i]->bounding_box(0, 0, boxes[i]))
+                    std::cerr << "No bounding box in BVH constructor.\n";
+                indices[i] = (uint32_t)i;
+            }
+        }
 
-        int axis = random_int(0, 2);
-        auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+        // builds node over indices[start, end), at least two shapes
+        void build(BVH* node, std::size_t start, std::size_t end, BVHArena& arena) {
+            int axis = random_axis();
+            node->axis = axis;
+            std::sort(indices.begin() + start, indices.begin() + end, [this, axis](uint32_t a, uint32_t b) {
+                return boxes[a].minimum[axis] < boxes[b].minimum[axis];
+            });
 
+            node->box = rangeBox(start, end);
+            double area = node->box.area();
+            std::size_t bounds[3] = { start, start + (end - start) / 2, end };
+            for (int c = 0; c < 2; c++) {
+                std::size_t first = bounds[c], last = bounds[c + 1];
+                std::size_t count = last - first;
+                if (count <= (std::size_t)maxLeafSize
+                    && (count == 1 || bvh_leaf_is_cheaper(leafTestCost(first, last), area, rangeBox(first, last).area()))) {
+                    node->set_child(c, makeRun(first, last, arena), (int)count);
+                }
+                else {
+                    BVH* child = arena.allocate();
+                    node->set_child(c, child);
+                    build(child, first, last, arena);
+                }
+            }
+        }
 
-        std::size_t object_span = end - start;
-        
-        if (object_span == 1) {          
-            left = right = objects[start];
+        // copies the shapes of indices[first, last) into a leaf run
+        const PrimitiveRef* makeRun(std::size_t first, std::size_t last, BVHArena& arena) {
+            PrimitiveRef* run = arena.allocatePrimitives(last - first);
+            for (std::size_t i = first; i < last; ++i)
+                run[i - first] = PrimitiveRef(shapes[indices[i]]);
+            return run;
         }
-        else if (object_span == 2) {
-            if (comparator(objects[start], objects[start+1])) {
-                left = objects[start];
-                right = objects[start+1];
-            }
-            else {
-                left = objects[start+1];
-                right = objects[start];
-            }
+
+        float leafTestCost(std::size_t first, std::size_t last) const {
+            std::size_t spheres = 0;
+            for (std::size_t i = first; i < last; ++i)
+                if (shapes[indices[i]]->getKind() == SPHERE_PRIMITIVE) spheres++;
+            return bvh_leaf_test_cost(last - first, spheres);
         }
-        else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
-            std::size_t mid = start + object_span / 2;
-            left = new BVH(objects, start, mid, time0, time1);
-            right = new BVH(objects, mid, end, time0, time1);
+        aabb rangeBox(std::size_t first, std::size_t last) const {
+            aabb box = aabb::empty();
+            for (std::size_t i = first; i < last; ++i)
+                box.expand(boxes[indices[i]]);
+            return box;
         }
 
-        aabb box_left, box_right;
+    private:
+        const std::vector<Shape*>& shapes;
+        std::vector<aabb> boxes;        // shape bounds, computed once instead of in every comparison
+        std::vector<uint32_t> indices;  // permutation of the shapes, sorted in place range by range
+        int maxLeafSize;
+    };
 
-        if (!left->bounding_box(time0, time1, box_left)
-            || !right->bounding_box(time0, time1, box_right)
-            )
-            std::cerr << "No bounding box in BVH constructor.\n";
+} // namespace
 
-        box = surrounding_box(box_left, box_right);
+    /**
+     * Factory function that builds the BVH tree over the scene shapes
+     *
+     * @param shapes the scene shapes
+     * @param settings builder settings
+     * @param arena node storage, cleared and sized for the tree
+     *
+     * @return root node of the BVH tree
+     *
+     */
+    BVH* BVH::build(std::vector<Shape*>& shapes, const BVHSettings& settings, BVHArena& arena)
+    {
+        BVH* root;
+        if (settings.builder == std::string("sbvh")) {
+            SBVHBuilder builder(shapes, settings.splitBudget, settings.leafSize());
+            root = builder.build(arena);
+        }
+        else {
+            arena.reserve(BVHArena::maxNodes(shapes.size()), shapes.size());
+            root = arena.allocate();
+            MedianBuilder builder(shapes, settings.leafSize());
+            if (shapes.size() == 1) {
+                root->set_child(0, builder.makeRun(0, 1, arena), 1);
+                root->set_child(1, nullptr, 0);
+                root->box = builder.rangeBox(0, 1);
+            }
+            else {
+                builder.build(root, 0, shapes.size(), arena);
+            }
+        }
 
+        // optional post-pass: the treelets reuse their nodes, so the arena does not grow
+        TreeletOptimizer optimizer(settings.treeletPasses);
+        optimizer.optimize(root);
+        return root;
     }
 
 } //namespace rt
-
-
@@ -10,6 +10,8 @@
 #include "core/Shape.h"
 #include "core/RayHitStructs.h"
 #include "core/Material.h"
+#include "shapes/BVHStats.h"
+#include "shapes/Primitive.h"
 #include <cmath>
 #include <vector>
 #include <algorithm>
@@ -27,6 +29,72 @@ using std::sqrt;
 
 namespace rt{
 
+class BVHArena;
+
+// traversal stack depth, enough for any tree the builders produce
+const int BVH_STACK_SIZE = 64;
+
+// largest primitive run a leaf can hold, bounded by the compressed node format
+const int BVH_MAX_LEAF_SIZE = 15;
+
+// SAH cost of a node visit and of a primitive test, shared by the builders, the treelet pass and the stats
+const float BVH_TRAVERSAL_COST = 1.0f;
+const float BVH_INTERSECTION_COST = 1.0f;
+
+// SAH cost of testing a batch of up to 8 spheres at once (see SphereBatch)
+const float BVH_SPHERE_BATCH_COST = 1.0f;
+
+/*
+ * BVH builder settings, read from the scene "accelerator" specs
+ */
+struct BVHSettings {
+    std::string builder = "median"; // "median" (sorted halves on a random axis) or "sbvh" (SAH with spatial splits)
+    float splitBudget = 0.3f;       // sbvh: extra references allowed by spatial splits, as a fraction of the shape count
+    int maxLeafSize = 4;            // most primitives in a leaf, the SAH decides below that
+    int treeletPasses = 0;          // treelet restructuring passes run after the builder, 0 for none
+    bool compressed = false;        // quantize the built tree into 24-byte nodes (not part of the cache key)
+
+    // settings as a string, part of the BVH cache key
+    std::string describe() const {
+        std::string description = builder;
+        if (builder == std::string("sbvh"))
+            description += " budget " + std::to_string(splitBudget);
+        description += " leaf " + std::to_string(leafSize());
+        if (treeletPasses > 0)
+            description += " treelets " + std::to_string(treeletPasses);
+        return description;
+    }
+
+    // maxLeafSize within the supported range
+    int leafSize() const {
+        return std::min(std::max(maxLeafSize, 1), BVH_MAX_LEAF_SIZE);
+    }
+};
+
+//
+// SAH cost of the primitive tests of a leaf, whose spheres are batched when there are two or more of them
+//
+static inline float bvh_leaf_test_cost(std::size_t count, std::size_t spheres) {
+    if (spheres < 2)
+        return BVH_INTERSECTION_COST * count;
+    std::size_t batches = (spheres + SphereBatch::WIDTH - 1) / SphereBatch::WIDTH;
+    return BVH_INTERSECTION_COST * (count - spheres) + BVH_SPHERE_BATCH_COST * batches;
+}
+
+//
+// SAH leaf decision: a set of primitives under a parent box is kept as a leaf when testing all of them on every
+// visit of the parent is no dearer than giving them a node of their own (with the primitives as its leaves)
+//
+static inline bool bvh_leaf_is_cheaper(float testCost, double parentArea, double nodeArea) {
+    return testCost * parentArea <= nodeArea * (BVH_TRAVERSAL_COST + testCost);
+}
+
+/*
+ * BVH node.
+ * Each child is either an inner node or a leaf: a run of primitive references stored contiguously, in build order,
+ * in the arena of the tree. Leaves have no box of their own and are tested when their parent is visited. Only the root
+ * of a tree over a single leaf has one child, the right run being empty.
+ */
 class BVH :public Shape {
 
 public:
@@ -36,12 +104,14 @@ public:
     //
     BVH() {};
 
-    BVH(std::vector<Shape*> src_objects,
-        std::size_t start, std::size_t end,
-        double time0, double time1);
-
     virtual ~BVH() {};
 
+    //
+    // factory function : builds the tree over the shapes with the builder chosen in the settings,
+    // allocating the nodes and the leaves from the arena
+    //
+    static BVH* build(std::vector<Shape*>& shapes, const BVHSettings& settings, BVHArena& arena);
+
     Hit intersect(Ray ray) const {
         Hit h;
         return h;
@@ -56,7 +126,9 @@ public:
     }
 
     /**
-     * Test the intersection
+     * Test the intersection.
+     * Children are visited front to back along the split axis; the far child is kept on a stack with its
+     * entry distance and skipped if the closest hit found so far is nearer than that.
      *
      * @param r ray
      * @param t_min min distance
@@ -67,13 +139,114 @@ public:
      */
     bool hit(
         const Ray& r, double t_min, double t_max, Hit& rec) const {
-        if (!box.hit(r, t_min, t_max))
-            return false;             
-
-        bool hit_left = left->hit(r, t_min, t_max, rec);
-        bool hit_right = right->hit(r, t_min, hit_left ? rec.distance : t_max, rec);
+        float t_entry;
+        if (!box.hit(r, t_min, t_max, t_entry)) {
+            BVHCounters::record(r.raytype, 0, 0);
+            return false;
+        }
+
+        struct Pending {
+            const BVH* node;
+            float t_entry;
+        };
+        Pending stack[BVH_STACK_SIZE];
+        int stack_size = 0;
+
+        bool hit_anything = false;
+        float closest = t_max;
+        const BVH* node = this;
+        unsigned visits = 0, tests = 0;
+
+        while (node != nullptr) {
+            visits++;
+            int first = r.dirIsNeg[node->axis];
+
+            const BVH* next = nullptr;
+            for (int i = 0; i < 2; i++) {
+                int c = first ^ i;
+
+                // leaf: test the primitives right away so the far child sees the tighter distance
+                if (!node->child_is_node(c)) {
+                    const PrimitiveRef* run = node->child_run(c);
+                    int count = node->child_count(c);
+                    tests += count;
+                    for (int k = 0; k < count; k++) {
+                        if (primitive_hit(run[k], r, t_min, closest, rec)) {
+                            hit_anything = true;
+                            closest = rec.distance;
+                        }
+                    }
+                    continue;
+                }
+
+                const BVH* child = node->child_node(c);
+                float t_child;
+                if (!child->box.hit(r, t_min, closest, t_child))
+                    continue;
+                if (next == nullptr)
+                    next = child;
+                else
+                    stack[stack_size++] = { child, t_child };
+            }
+
+            // nothing to descend into: pop the next far child that can still hold a closer hit
+            while (next == nullptr && stack_size > 0) {
+                const Pending& pending = stack[--stack_size];
+                if (pending.t_entry < closest)
+                    next = pending.node;
+            }
+            node = next;
+        }
+
+        BVHCounters::record(r.raytype, visits, tests);
+        return hit_anything;
+    }
 
-        return hit_left || hit_right;
+    /**
+     * Test the occlusion, stopping at the first hit
+     *
+     * @param r shadow ray
+     * @param t_min min distance
+     * @param t_max max distance, usually the distance to the light
+     *
+     * @return true if any shape under the node hits the ray within [t_min, t_max]
+     */
+    bool occluded(const Ray& r, double t_min, double t_max) const {
+        if (!box.hit(r, t_min, t_max)) {
+            BVHCounters::record(r.raytype, 0, 0);
+            return false;
+        }
+
+        const BVH* stack[BVH_STACK_SIZE];
+        int stack_size = 0;
+        const BVH* node = this;
+        unsigned visits = 0, tests = 0;
+
+        while (true) {
+            visits++;
+            for (int c = 0; c < 2; c++) {
+                if (!node->child_is_node(c)) {
+                    const PrimitiveRef* run = node->child_run(c);
+                    int count = node->child_count(c);
+                    for (int k = 0; k < count; k++) {
+                        tests++;
+                        if (primitive_occluded(run[k], r, t_min, t_max)) {
+                            BVHCounters::record(r.raytype, visits, tests);
+                            return true;
+                        }
+                    }
+                }
+                else if (node->child_node(c)->box.hit(r, t_min, t_max)) {
+                    stack[stack_size++] = node->child_node(c);
+                }
+            }
+
+            if (stack_size == 0) {
+                BVHCounters::record(r.raytype, visits, tests);
+                return false;
+            }
+            node = stack[--stack_size];
+        }
     }
 
     //
@@ -82,58 +255,152 @@ public:
     bool bounding_box(double time0, double time1, aabb& output_box) const {
         output_box = box;
         return true;
-    }    
+    }
+
+    //
+    // true for the root of a tree over a single leaf, whose right run is empty
+    //
+    bool has_single_child() const {
+        return !right_is_node && right_count == 0;
+    }
+
+    //
+    // Child access by index, 0 for left and 1 for right
+    //
+    bool child_is_node(int c) const {
+        return c == 0 ? left_is_node : right_is_node;
+    }
 
-    double random_double() const {
-        // Returns a random real in [0,1).
-        return rand() / (RAND_MAX + 1.0);
+    const BVH* child_node(int c) const {
+        return static_cast<const BVH*>(c == 0 ? left : right);
     }
 
-    double random_double(double min, double max) const {
-        // Returns a random real in [min,max).
-        return min + (max - min) * random_double();
+    BVH* child_node(int c) {
+        return static_cast<BVH*>(c == 0 ? left : right);
     }
 
-    int random_int(int min, int max) const {
-        // Returns a random integer in [min,max].
-        return static_cast<int>(random_double(min, max + 1));
+    const PrimitiveRef* child_run(int c) const {
+        return c == 0 ? left_run : right_run;
+    }
+
+    int child_count(int c) const {
+        return c == 0 ? left_count : right_count;
+    }
+
+    void set_child(int c, BVH* node) {
+        (c == 0 ? left : right) = node;
+        (c == 0 ? left_is_node : right_is_node) = true;
+        (c == 0 ? left_count : right_count) = 0;
+    }
+
+    void set_child(int c, const PrimitiveRef* run, int count) {
+        (c == 0 ? left_run : right_run) = run;
+        (c == 0 ? left_is_node : right_is_node) = false;
+        (c == 0 ? left_count : right_count) = (uint8_t)count;
     }
 
-    
-    
 public:
-    Shape* left;
-    Shape* right;
+    union {
+        Shape* left = nullptr;      // inner child node
+        const PrimitiveRef* left_run;   // leaf: first primitive of the run
+    };
+    union {
+        Shape* right = nullptr;
+        const PrimitiveRef* right_run;
+    };
     aabb box;
-    Material* left_material;
-    Material* right_material;
+    int axis = 0;               // split axis, orders the traversal
+    bool left_is_node = false;  // child is an inner BVH node rather than a run of primitives
+    bool right_is_node = false;
+    uint8_t left_count = 0;     // primitives in the run
+    uint8_t right_count = 0;
 };
 
-//
-// Helper functions for bounding boxes comparison/computation
-//
-static inline bool box_compare(const Shape* a, const Shape* b, int axis) {
-    aabb box_a;
-    aabb box_b;
+/*
+ * Storage of a BVH tree: the nodes and the primitive runs of the leaves.
+ * Both are handed out from blocks allocated up front, so the builders do no allocation per node and pointers stay
+ * valid while the tree grows. Reserve before building to get a single block of each; the whole tree is freed at
+ * once when the arena is cleared or destroyed.
+ */
+class BVHArena {
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in BVH constructor.\n";
+public:
 
-    return box_a.min()[axis] < box_b.min()[axis];
-}
+    //
+    // Constructors
+    //
+    BVHArena() : used(0), blockSize(DEFAULT_BLOCK_SIZE), primitivesUsed(0), primitiveBlockSize(DEFAULT_BLOCK_SIZE) {};
 
-static bool box_x_compare(const Shape* a, const Shape* b)  {
-    return box_compare(a, b, 0);
-}
+    //
+    // drops any previous tree and allocates room for the given number of nodes and leaf primitives
+    //
+    void reserve(std::size_t count, std::size_t primitives) {
+        clear();
+        blockSize = std::max(count, (std::size_t)1);
+        blocks.emplace_back(new BVH[blockSize]);
+        primitiveBlockSize = std::max(primitives, (std::size_t)BVH_MAX_LEAF_SIZE);
+        primitiveBlocks.emplace_back(new PrimitiveRef[primitiveBlockSize]);
+    }
 
-static bool box_y_compare(const Shape* a, const Shape* b)  {
-    return box_compare(a, b, 1);
-}
+    //
+    // returns a default node, adding a block if the reserved room is used up
+    //
+    BVH* allocate() {
+        if (blocks.empty() || used == blockSize) {
+            blocks.emplace_back(new BVH[blockSize]);
+            used = 0;
+        }
+        return &blocks.back()[used++];
+    }
 
-static bool box_z_compare(const Shape* a, const Shape* b)  {
-    return box_compare(a, b, 2);
-}
+    //
+    // returns room for a run of count primitives, contiguous and following the previous run when it fits
+    //
+    PrimitiveRef* allocatePrimitives(std::size_t count) {
+        if (primitiveBlocks.empty() || primitivesUsed + count > primitiveBlockSize) {
+            primitiveBlockSize = std::max(primitiveBlockSize, count);
+            primitiveBlocks.emplace_back(new PrimitiveRef[primitiveBlockSize]);
+            primitivesUsed = 0;
+        }
+        PrimitiveRef* run = &primitiveBlocks.back()[primitivesUsed];
+        primitivesUsed += count;
+        return run;
+    }
+
+    //
+    // frees all nodes and runs
+    //
+    void clear() {
+        blocks.clear();
+        used = 0;
+        primitiveBlocks.clear();
+        primitivesUsed = 0;
+    }
 
+    //
+    // number of nodes handed out
+    //
+    std::size_t size() const {
+        return blocks.empty() ? 0 : (blocks.size() - 1) * blockSize + used;
+    }
+
+    //
+    // upper bound of the inner nodes of a binary tree with the given number of leaves
+    //
+    static std::size_t maxNodes(std::size_t leaves) {
+        return leaves > 1 ? leaves - 1 : 1;
+    }
+
+private:
+    static const std::size_t DEFAULT_BLOCK_SIZE = 1024;
+
+    std::vector<std::unique_ptr<BVH[]>> blocks;
+    std::size_t used;           // nodes handed out from the last block
+    std::size_t blockSize;
+    std::vector<std::unique_ptr<PrimitiveRef[]>> primitiveBlocks;
+    std::size_t primitivesUsed; // primitive slots handed out from the last block
+    std::size_t primitiveBlockSize;
+};
 
 } //namespace rt
 
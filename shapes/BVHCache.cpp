@@ -0,0 +1,310 @@
+/*
+ * BVHCache.cpp
+ *
+ *
+ */
+#include "BVHCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt{
+
+namespace {
+
+    const char CACHE_MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 'C', '0', '\0' };
+    const uint32_t CACHE_VERSION = 6;   // also bumped when the builders change the trees they make
+
+    //
+    // File layout: header, nodeCount nodes in depth-first order with the root first,
+    // then primitiveCount shape indices holding the leaf runs
+    //
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodeCount;
+        uint64_t key;
+        uint32_t shapeCount;
+        uint32_t primitiveCount;
+    };
+
+    // child >= 0 is a node index, child < 0 is a run of count shapes starting at -(child + 1) in the run table
+    struct CacheNode {
+        float minimum[3];
+        float maximum[3];
+        int32_t left;
+        int32_t right;
+        int32_t axis;
+        int32_t leftCount;
+        int32_t rightCount;
+    };
+
+    /*
+     * Read-only memory mapping of a whole file, unmapped on destruction
+     */
+    class MappedFile {
+    public:
+        MappedFile(const std::string& path) : data(nullptr), size(0) {
+#ifdef _WIN32
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) return;
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping == NULL) return;
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (data != nullptr) size = (std::size_t)fileSize.QuadPart;
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = p;
+                    size = (std::size_t)st.st_size;
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~MappedFile() {
+#ifdef _WIN32
+            if (data != nullptr) UnmapViewOfFile(const_cast<void*>(data));
+            if (mapping != NULL) CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+            if (data != nullptr) munmap(const_cast<void*>(data), size);
+#endif
+        }
+
+        const void* data;
+        std::size_t size;
+
+    private:
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = NULL;
+#endif
+    };
+
+    /*
+     * Appends the subtree under node to out in depth-first order, its leaf runs to runs, and returns its index
+     */
+    int32_t flatten(const BVH* node, const std::unordered_map<const Shape*, uint32_t>& shapeIndex,
+        std::vector<CacheNode>& out, std::vector<uint32_t>& runs) {
+        int32_t index = (int32_t)out.size();
+        out.push_back(CacheNode());
+        for (int a = 0; a < 3; a++) {
+            out[index].minimum[a] = node->box.minimum[a];
+            out[index].maximum[a] = node->box.maximum[a];
+        }
+
+        int32_t links[2], counts[2];
+        for (int c = 0; c < 2; c++) {
+            if (node->child_is_node(c)) {
+                links[c] = flatten(node->child_node(c), shapeIndex, out, runs);
+                counts[c] = 0;
+                continue;
+            }
+            links[c] = -((int32_t)runs.size() + 1);
+            counts[c] = node->child_count(c);
+            for (int k = 0; k < counts[c]; k++)
+                runs.push_back(shapeIndex.find(node->child_run(c)[k].shape())->second);
+        }
+        out[index].left = links[0];
+        out[index].right = links[1];
+        out[index].leftCount = counts[0];
+        out[index].rightCount = counts[1];
+        out[index].axis = node->axis;
+        return index;
+    }
+
+} // namespace
+
+
+    /**
+     * Hash function over everything the BVH builder reads: the exact geometry of every shape, since the
+     * spatial split builder clips it, not only its bounds
+     *
+     * @param shapes the scene shapes in scene order
+     * @param builder the builder name and settings
+     *
+     * @return 64-bit cache key
+     *
+     */
+    uint64_t BVHCache::hashShapes(const std::vector<Shape*>& shapes, const std::string& builder)
+    {
+        uint64_t h = 14695981039346656037ull;
+        hash_bytes(h, &CACHE_VERSION, sizeof(CACHE_VERSION));
+        hash_bytes(h, builder.data(), builder.size());
+
+        uint64_t count = shapes.size();
+        hash_bytes(h, &count, sizeof(count));
+        for (const Shape* shape : shapes) {
+            std::string type = shape->getType();
+            hash_bytes(h, type.data(), type.size());
+            shape->hash(h);
+        }
+        return h;
+    }
+
+    /**
+     * Writes the BVH tree to the cache file
+     *
+     * @param path cache file path
+     * @param key cache key from hashShapes
+     * @param root root node of the BVH tree
+     * @param shapes the scene shapes the tree was built from
+     *
+     * @return true if the file was written
+     *
+     */
+    bool BVHCache::save(const std::string& path, uint64_t key, const BVH* root, const std::vector<Shape*>& shapes)
+    {
+        std::unordered_map<const Shape*, uint32_t> shapeIndex;
+        for (std::size_t i = 0; i < shapes.size(); ++i) {
+            shapeIndex.emplace(shapes[i], (uint32_t)i);
+        }
+
+        std::vector<CacheNode> nodes;
+        std::vector<uint32_t> runs;
+        nodes.reserve(BVHArena::maxNodes(shapes.size()));
+        runs.reserve(shapes.size());
+        flatten(root, shapeIndex, nodes, runs);
+
+        CacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.nodeCount = (uint32_t)nodes.size();
+        header.key = key;
+        header.shapeCount = (uint32_t)shapes.size();
+        header.primitiveCount = (uint32_t)runs.size();
+
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (!ofs) return false;
+        ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(CacheNode));
+        ofs.write(reinterpret_cast<const char*>(runs.data()), runs.size() * sizeof(uint32_t));
+        return (bool)ofs;
+    }
+
+    /**
+     * Reads the cache file through a read-only mapping, copying the stored nodes into the arena and
+     * relinking them against the scene shapes
+     *
+     * @param path cache file path
+     * @param key expected cache key
+     * @param shapes the scene shapes
+     * @param arena node storage, cleared and sized for the tree
+     *
+     * @return root node of the BVH tree, nullptr if the cache is missing, corrupt or stale
+     *
+     */
+    BVH* BVHCache::load(const std::string& path, uint64_t key, const std::vector<Shape*>& shapes, BVHArena& arena)
+    {
+        MappedFile file(path);
+        if (file.data == nullptr || file.size < sizeof(CacheHeader)) return nullptr;
+
+        const CacheHeader* header = static_cast<const CacheHeader*>(file.data);
+        if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != CACHE_VERSION
+            || header->key != key
+            || header->shapeCount != shapes.size()
+            || header->nodeCount == 0
+            || file.size != sizeof(CacheHeader) + (std::size_t)header->nodeCount * sizeof(CacheNode)
+                + (std::size_t)header->primitiveCount * sizeof(uint32_t))
+            return nullptr;
+
+        const CacheNode* cached = reinterpret_cast<const CacheNode*>(header + 1);
+        const uint32_t* runs = reinterpret_cast<const uint32_t*>(cached + header->nodeCount);
+        arena.reserve(header->nodeCount, header->primitiveCount);
+        std::vector<BVH*> nodes(header->nodeCount);
+        for (BVH*& node : nodes) node = arena.allocate();
+
+        // all runs in one block, in file order
+        PrimitiveRef* primitives = arena.allocatePrimitives(header->primitiveCount);
+        for (uint32_t k = 0; k < header->primitiveCount; ++k) {
+            if (runs[k] >= shapes.size()) {
+                arena.clear();
+                return nullptr;
+            }
+            primitives[k] = PrimitiveRef(shapes[runs[k]]);
+        }
+
+        for (int32_t i = 0; i < (int32_t)header->nodeCount; ++i) {
+            BVH* node = nodes[i];
+            int32_t links[2] = { cached[i].left, cached[i].right };
+            int32_t counts[2] = { cached[i].leftCount, cached[i].rightCount };
+            for (int c = 0; c < 2; c++) {
+                int32_t link = links[c];
+                if (link > i && link < (int32_t)header->nodeCount) {
+                    node->set_child(c, nodes[link]);
+                }
+                else if (link < 0 && counts[c] >= 0 && counts[c] <= BVH_MAX_LEAF_SIZE
+                    && (std::size_t)(-(link + 1)) + counts[c] <= header->primitiveCount) {
+                    node->set_child(c, counts[c] > 0 ? primitives + (-(link + 1)) : nullptr, counts[c]);
+                }
+                else {
+                    arena.clear();
+                    return nullptr;
+                }
+            }
+            node->box = aabb(Vec3f(cached[i].minimum[0], cached[i].minimum[1], cached[i].minimum[2]),
+                Vec3f(cached[i].maximum[0], cached[i].maximum[1], cached[i].maximum[2]));
+            node->axis = cached[i].axis >= 0 && cached[i].axis < 3 ? cached[i].axis : 0;
+        }
+        return nodes[0];
+    }
+
+    /**
+     * Returns the BVH tree of the shapes, read from the cache file when it matches the scene
+     *
+     * @param shapes the scene shapes
+     * @param settings builder settings
+     * @param path cache file path, empty to always build
+     * @param arena node storage of the tree
+     *
+     * @return root node of the BVH tree
+     *
+     */
+    BVH* BVHCache::buildOrLoad(std::vector<Shape*>& shapes, const BVHSettings& settings, const std::string& path,
+        BVHArena& arena)
+    {
+        clock_t timeStart = clock();
+        uint64_t key = 0;
+
+        if (!path.empty()) {
+            key = hashShapes(shapes, settings.describe());
+            BVH* root = load(path, key, shapes, arena);
+            if (root != nullptr) {
+                printf("BVH loaded from cache: %s (%04.2f ms)\n", path.c_str(), 1000.0f * (clock() - timeStart) / CLOCKS_PER_SEC);
+                return root;
+            }
+        }
+
+        BVH* root = BVH::build(shapes, settings, arena);
+        printf("BVH build time: %04.2f (ms)\n", 1000.0f * (clock() - timeStart) / CLOCKS_PER_SEC);
+
+        if (!path.empty() && !save(path, key, root, shapes)) {
+            std::cerr << "Could not write BVH cache " << path << std::endl;
+        }
+        return root;
+    }
+
+} //namespace rt
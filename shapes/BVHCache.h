@@ -0,0 +1,56 @@
+/*
+ * BVHCache.h
+ *
+ *
+ */
+
+#ifndef BVHCACHE_H_
+#define BVHCACHE_H_
+
+#include "core/Shape.h"
+#include "shapes/BVH.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rt{
+
+/*
+ * On-disk cache of built BVH trees.
+ * The cache file stores the flattened tree (node bounds and child links, leaf runs as indices into
+ * the scene shapes) and is keyed by a hash of the data the builder consumes, so an unchanged
+ * scene maps the file and copies the nodes into its arena, relinking them, instead of sorting
+ * the shapes again.
+ */
+class BVHCache {
+
+public:
+
+    //
+    // hash function : returns the cache key of the shapes and the builder settings
+    //
+    static uint64_t hashShapes(const std::vector<Shape*>& shapes, const std::string& builder);
+
+    //
+    // save function : writes the tree under root to the cache file, returns false on I/O failure
+    //
+    static bool save(const std::string& path, uint64_t key, const BVH* root, const std::vector<Shape*>& shapes);
+
+    //
+    // load function : returns the cached tree with its nodes in the arena, or nullptr if the file is missing or stale
+    //
+    static BVH* load(const std::string& path, uint64_t key, const std::vector<Shape*>& shapes, BVHArena& arena);
+
+    //
+    // factory function : returns the cached tree if the key matches, otherwise builds and caches it
+    //
+    static BVH* buildOrLoad(std::vector<Shape*>& shapes, const BVHSettings& settings, const std::string& path,
+        BVHArena& arena);
+
+};
+
+} //namespace rt
+
+
+
+#endif /* BVHCACHE_H_ */
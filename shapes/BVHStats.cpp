@@ -0,0 +1,141 @@
+/*
+ * BVHStats.cpp
+ *
+ *
+ */
+#include "BVHStats.h"
+#include "BVH.h"
+
+#include <algorithm>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include "rapidjson/prettywriter.h"
+#include "rapidjson/stringbuffer.h"
+
+namespace rt{
+
+    bool BVHCounters::enabled = false;
+    BVHCounters::Counts BVHCounters::counts[3];
+
+namespace {
+
+    const char* RAY_TYPE_NAMES[3] = { "PRIMARY", "SECONDARY", "SHADOW" };
+
+} // namespace
+
+    /**
+     * Walks the tree and gathers its quality measures
+     *
+     * @param root root node of the BVH tree
+     *
+     * @return tree statistics, without traversal counters
+     *
+     */
+    BVHStats BVHStats::measure(const BVH* root)
+    {
+        BVHStats stats;
+        double rootArea = root->box.area();
+        if (rootArea <= 0) rootArea = 1;
+
+        double depthSum = 0;
+        std::vector<std::pair<const BVH*, int>> pending(1, std::make_pair(root, 0));
+        while (!pending.empty()) {
+            const BVH* node = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+
+            double area = node->box.area() / rootArea;
+            stats.innerNodes++;
+            stats.relativeArea += area;
+            stats.sahCost += BVH_TRAVERSAL_COST * area;
+
+            for (int c = 0; c < 2; c++) {
+                if (node->child_is_node(c)) {
+                    pending.push_back(std::make_pair(node->child_node(c), depth + 1));
+                    continue;
+                }
+
+                int count = node->child_count(c);
+                if (count == 0)
+                    continue;
+                stats.leafNodes++;
+                stats.primitiveReferences += count;
+                stats.sahCost += BVH_INTERSECTION_COST * area * count;
+                stats.leafHistogram[count]++;
+                stats.maxDepth = std::max(stats.maxDepth, depth + 1);
+                depthSum += depth + 1;
+            }
+        }
+
+        if (stats.leafNodes > 0)
+            stats.averageDepth = depthSum / stats.leafNodes;
+        return stats;
+    }
+
+    /**
+     * Formats the report as JSON
+     *
+     * @return the JSON document
+     *
+     */
+    std::string BVHStats::toJSON() const
+    {
+        rapidjson::StringBuffer buffer;
+        rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+
+        writer.StartObject();
+        writer.Key("tree");
+        writer.StartObject();
+        writer.Key("innerNodes"); writer.Uint64(innerNodes);
+        writer.Key("leafNodes"); writer.Uint64(leafNodes);
+        writer.Key("primitiveReferences"); writer.Uint64(primitiveReferences);
+        writer.Key("maxDepth"); writer.Int(maxDepth);
+        writer.Key("averageDepth"); writer.Double(averageDepth);
+        writer.Key("sahCost"); writer.Double(sahCost);
+        writer.Key("relativeArea"); writer.Double(relativeArea);
+        writer.Key("leafHistogram");
+        writer.StartObject();
+        for (const auto& bin : leafHistogram) {
+            writer.Key(std::to_string(bin.first).c_str());
+            writer.Uint64(bin.second);
+        }
+        writer.EndObject();
+        writer.EndObject();
+
+        writer.Key("traversal");
+        writer.StartObject();
+        for (int type = 0; type < 3; type++) {
+            const BVHCounters::Counts& c = BVHCounters::counts[type];
+            double rays = c.rays > 0 ? (double)c.rays : 1.0;
+            writer.Key(RAY_TYPE_NAMES[type]);
+            writer.StartObject();
+            writer.Key("rays"); writer.Uint64(c.rays);
+            writer.Key("nodeVisitsPerRay"); writer.Double(c.nodeVisits / rays);
+            writer.Key("primitiveTestsPerRay"); writer.Double(c.primitiveTests / rays);
+            writer.EndObject();
+        }
+        writer.EndObject();
+        writer.EndObject();
+
+        return std::string(buffer.GetString(), buffer.GetSize());
+    }
+
+    /**
+     * Writes the JSON report to a file
+     *
+     * @param path output file path
+     *
+     * @return true if the file was written
+     *
+     */
+    bool BVHStats::save(const std::string& path) const
+    {
+        std::ofstream ofs(path, std::ios::trunc);
+        if (!ofs) return false;
+        ofs << toJSON() << std::endl;
+        return (bool)ofs;
+    }
+
+} //namespace rt
@@ -0,0 +1,104 @@
+/*
+ * BVHStats.h
+ *
+ *
+ */
+
+#ifndef BVHSTATS_H_
+#define BVHSTATS_H_
+
+#include "core/RayHitStructs.h"
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace rt{
+
+class BVH;
+
+/*
+ * Node visits and primitive tests of the BVH queries, per ray type.
+ * The queries count in locals and add them here once per ray, and only while counting is enabled.
+ */
+class BVHCounters {
+
+public:
+
+    struct Counts {
+        uint64_t rays = 0;
+        uint64_t nodeVisits = 0;
+        uint64_t primitiveTests = 0;
+    };
+
+    //
+    // starts counting from zero
+    //
+    static void enable() {
+        enabled = true;
+        for (Counts& c : counts) c = Counts();
+    }
+
+    //
+    // stops counting, keeping the counts
+    //
+    static void disable() {
+        enabled = false;
+    }
+
+    //
+    // adds one query of a ray
+    //
+    static inline void record(RayType type, unsigned nodeVisits, unsigned primitiveTests) {
+        if (!enabled)
+            return;
+        Counts& c = counts[type];
+        c.rays++;
+        c.nodeVisits += nodeVisits;
+        c.primitiveTests += primitiveTests;
+    }
+
+    static Counts counts[3];    // indexed by RayType
+
+private:
+    static bool enabled;
+};
+
+/*
+ * Quality report of a built BVH tree, with the traversal counters of the render once it is done.
+ * SAH cost uses the BVH traversal and intersection costs: every inner node costs its area relative to
+ * the root, every primitive the area of the node whose leaf holds it.
+ */
+class BVHStats {
+
+public:
+
+    //
+    // measures the tree under root
+    //
+    static BVHStats measure(const BVH* root);
+
+    //
+    // returns the report, with the current BVHCounters, as a JSON document
+    //
+    std::string toJSON() const;
+
+    //
+    // writes toJSON() to a file, returns false on I/O failure
+    //
+    bool save(const std::string& path) const;
+
+    std::size_t innerNodes = 0;
+    std::size_t leafNodes = 0;            // primitive runs
+    std::size_t primitiveReferences = 0;  // more than the shapes when spatial splits duplicate them
+    int maxDepth = 0;                     // of the leaves, the root is at depth 0 and its leaves at 1
+    double averageDepth = 0;
+    double sahCost = 0;
+    double relativeArea = 0;              // summed inner node area over the root area
+    std::map<int, std::size_t> leafHistogram; // primitives per leaf -> number of leaves
+};
+
+} //namespace rt
+
+
+
+#endif /* BVHSTATS_H_ */
@@ -0,0 +1,248 @@
+/*
+ * CompressedBVH.cpp
+ *
+ *
+ */
+#include "CompressedBVH.h"
+#include <algorithm>
+#include <cmath>
+
+namespace rt{
+
+    /**
+     * Constructor that quantizes a built BVH tree, root first in depth-first order
+     *
+     * @param root root node of the BVH tree
+     *
+     */
+    CompressedBVH::CompressedBVH(const BVH* root)
+    {
+        rootBox = root->box;
+        encode(root, rootBox);
+    }
+
+    /**
+     * Appends the quantized subtree under node
+     *
+     * @param node the BVH node
+     * @param box decoded box of the node, the frame its children are quantized in
+     *
+     * @return index of the quantized node
+     *
+     */
+    uint32_t CompressedBVH::encode(const BVH* node, const aabb& box)
+    {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back(QuantizedNode());
+
+        QuantizedNode q;
+        memset(&q, 0, sizeof(q));
+        q.axis = (uint8_t)node->axis;
+
+        // smallest power of two step that spans the box in 254 steps, leaving one step for rounding
+        for (int a = 0; a < 3; a++) {
+            float extent = box.maximum[a] - box.minimum[a];
+            int e = -126;
+            if (extent > 0) {
+                frexp(extent / 254.0f, &e);
+                if (254.0f * ldexp(1.0f, e) < extent) e++;
+            }
+            q.exponent[a] = (int8_t)std::min(std::max(e, -126), 127);
+        }
+
+        Vec3f steps = quantized_steps(q);
+        aabb decoded[2];
+        for (int c = 0; c < 2; c++) {
+            // a leaf run only matters inside this node (spatial splits can share a shape between nodes)
+            aabb exact;
+            if (node->child_is_node(c)) {
+                exact = node->child_node(c)->box;
+            }
+            else {
+                exact = aabb::empty();
+                for (int k = 0; k < node->child_count(c); k++) {
+                    aabb shape_box;
+                    node->child_run(c)[k].shape()->bounding_box(0, 0, shape_box);
+                    exact.expand(shape_box);
+                }
+                exact = intersect_boxes(exact, node->box);
+
+                // the empty run of a single leaf root
+                if (exact.is_empty())
+                    exact = aabb(box.minimum, box.minimum);
+            }
+
+            for (int a = 0; a < 3; a++) {
+                float step = steps[a];
+                int lo = (int)std::floor((exact.minimum[a] - box.minimum[a]) / step);
+                int hi = (int)std::ceil((exact.maximum[a] - box.minimum[a]) / step);
+                lo = std::min(std::max(lo, 0), 255);
+                hi = std::min(std::max(hi, lo), 255);
+
+                // conservative rounding: the decoded box must contain the exact one
+                while (lo > 0 && box.minimum[a] + lo * step > exact.minimum[a]) lo--;
+                while (hi < 255 && box.minimum[a] + hi * step < exact.maximum[a]) hi++;
+                q.lo[c][a] = (uint8_t)lo;
+                q.hi[c][a] = (uint8_t)hi;
+            }
+            decoded[c] = dequantize_box(q, c, box, steps);
+        }
+
+        for (int c = 0; c < 2; c++) {
+            if (node->child_is_node(c)) {
+                q.child[c] = encode(node->child_node(c), decoded[c]);
+                continue;
+            }
+            uint32_t first = (uint32_t)primitives.size();
+            primitives.insert(primitives.end(), node->child_run(c), node->child_run(c) + node->child_count(c));
+            q.child[c] = QUANTIZED_LEAF | (uint32_t)node->child_count(c) << QUANTIZED_COUNT_SHIFT | first;
+        }
+
+        nodes[index] = q;
+        return index;
+    }
+
+    /**
+     * Test the intersection, front to back along the split axis like BVH::hit, decoding the child boxes
+     * on the way down
+     *
+     * @param r ray
+     * @param t_min min distance
+     * @param t_max max distance
+     * @param rec hit records
+     *
+     * @return true if ray hits the shape, false otherwise
+     */
+    bool CompressedBVH::hit(const Ray& r, double t_min, double t_max, Hit& rec) const
+    {
+        float t_entry;
+        if (!rootBox.hit(r, t_min, t_max, t_entry)) {
+            BVHCounters::record(r.raytype, 0, 0);
+            return false;
+        }
+
+        struct Pending {
+            uint32_t node;
+            aabb box;
+            float t_entry;
+        };
+        Pending stack[BVH_STACK_SIZE];
+        int stack_size = 0;
+
+        bool hit_anything = false;
+        float closest = t_max;
+        uint32_t node = 0;
+        aabb box = rootBox;
+        unsigned visits = 0, tests = 0;
+
+        while (true) {
+            visits++;
+            const QuantizedNode& q = nodes[node];
+            Vec3f steps = quantized_steps(q);
+            int first = r.dirIsNeg[q.axis] ? 1 : 0;
+
+            bool descend = false;
+            uint32_t next = 0;
+            aabb next_box;
+            for (int i = 0; i < 2; i++) {
+                int c = first ^ i;
+                aabb child_box = dequantize_box(q, c, box, steps);
+                float t_child;
+                if (!child_box.hit(r, t_min, closest, t_child))
+                    continue;
+
+                if (q.child[c] & QUANTIZED_LEAF) {
+                    const PrimitiveRef* run = &primitives[0] + quantized_run_first(q.child[c]);
+                    int count = quantized_run_count(q.child[c]);
+                    tests += count;
+                    for (int k = 0; k < count; k++) {
+                        if (primitive_hit(run[k], r, t_min, closest, rec)) {
+                            hit_anything = true;
+                            closest = rec.distance;
+                        }
+                    }
+                }
+                else if (!descend) {
+                    descend = true;
+                    next = q.child[c];
+                    next_box = child_box;
+                }
+                else {
+                    stack[stack_size++] = { q.child[c], child_box, t_child };
+                }
+            }
+
+            while (!descend && stack_size > 0) {
+                const Pending& pending = stack[--stack_size];
+                if (pending.t_entry < closest) {
+                    descend = true;
+                    next = pending.node;
+                    next_box = pending.box;
+                }
+            }
+            if (!descend) {
+                BVHCounters::record(r.raytype, visits, tests);
+                return hit_anything;
+            }
+            node = next;
+            box = next_box;
+        }
+    }
+
+    /**
+     * Test the occlusion, stopping at the first hit
+     *
+     * @param r shadow ray
+     * @param t_min min distance
+     * @param t_max max distance, usually the distance to the light
+     *
+     * @return true if any shape hits the ray within [t_min, t_max]
+     */
+    bool CompressedBVH::occluded(const Ray& r, double t_min, double t_max) const
+    {
+        if (!rootBox.hit(r, t_min, t_max)) {
+            BVHCounters::record(r.raytype, 0, 0);
+            return false;
+        }
+
+        struct Pending {
+            uint32_t node;
+            aabb box;
+        };
+        Pending stack[BVH_STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, rootBox };
+        unsigned visits = 0, tests = 0;
+
+        while (stack_size > 0) {
+            visits++;
+            Pending current = stack[--stack_size];
+            const QuantizedNode& q = nodes[current.node];
+            Vec3f steps = quantized_steps(q);
+
+            for (int c = 0; c < 2; c++) {
+                aabb child_box = dequantize_box(q, c, current.box, steps);
+                if (!child_box.hit(r, t_min, t_max))
+                    continue;
+
+                if (q.child[c] & QUANTIZED_LEAF) {
+                    const PrimitiveRef* run = &primitives[0] + quantized_run_first(q.child[c]);
+                    int count = quantized_run_count(q.child[c]);
+                    for (int k = 0; k < count; k++) {
+                        tests++;
+                        if (primitive_occluded(run[k], r, t_min, t_max)) {
+                            BVHCounters::record(r.raytype, visits, tests);
+                            return true;
+                        }
+                    }
+                }
+                else {
+                    stack[stack_size++] = { q.child[c], child_box };
+                }
+            }
+        }
+        BVHCounters::record(r.raytype, visits, tests);
+        return false;
+    }
+
+} //namespace rt
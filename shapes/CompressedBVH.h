@@ -0,0 +1,126 @@
+/*
+ * CompressedBVH.h
+ *
+ *
+ */
+
+#ifndef COMPRESSEDBVH_H_
+#define COMPRESSEDBVH_H_
+
+#include "core/Shape.h"
+#include "core/RayHitStructs.h"
+#include "shapes/BVH.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace rt{
+
+/*
+ * Quantized BVH node, 24 bytes instead of a full BVH object.
+ * The boxes of both children are stored as 8-bit offsets from the minimum corner of this node's
+ * (decoded) box, in steps of a power of two per axis. Encoding rounds outwards, so a decoded box always
+ * contains the exact one. The root box is kept in full precision by CompressedBVH.
+ */
+struct QuantizedNode {
+    uint8_t lo[2][3];           // child box minimum, in steps from this node's minimum
+    uint8_t hi[2][3];           // child box maximum
+    int8_t exponent[3];         // step size per axis is 2^exponent
+    uint8_t axis;               // split axis, orders the traversal
+    uint32_t child[2];          // inner node index, or a leaf: QUANTIZED_LEAF | run length << 27 | first primitive
+};
+
+const uint32_t QUANTIZED_LEAF = 0x80000000u;
+const int QUANTIZED_COUNT_SHIFT = 27;
+const uint32_t QUANTIZED_FIRST_MASK = (1u << QUANTIZED_COUNT_SHIFT) - 1;
+
+//
+// Leaf run of a child, as an offset into the primitives and a length
+//
+static inline uint32_t quantized_run_first(uint32_t child) {
+    return child & QUANTIZED_FIRST_MASK;
+}
+
+static inline int quantized_run_count(uint32_t child) {
+    return (int)((child & ~QUANTIZED_LEAF) >> QUANTIZED_COUNT_SHIFT);
+}
+
+//
+// Step size 2^exponent, built from the float exponent bits
+//
+static inline float quantized_step(int8_t exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float step;
+    memcpy(&step, &bits, sizeof(step));
+    return step;
+}
+
+//
+// Decodes a child box, shared by the encoder and the traversal so both round the same way
+//
+static inline aabb dequantize_box(const QuantizedNode& node, int c, const aabb& box, const Vec3f& step) {
+    return aabb(Vec3f(box.minimum.x + node.lo[c][0] * step.x, box.minimum.y + node.lo[c][1] * step.y, box.minimum.z + node.lo[c][2] * step.z),
+        Vec3f(box.minimum.x + node.hi[c][0] * step.x, box.minimum.y + node.hi[c][1] * step.y, box.minimum.z + node.hi[c][2] * step.z));
+}
+
+//
+// Step sizes of all three axes of a node
+//
+static inline Vec3f quantized_steps(const QuantizedNode& node) {
+    return Vec3f(quantized_step(node.exponent[0]), quantized_step(node.exponent[1]), quantized_step(node.exponent[2]));
+}
+
+class CompressedBVH :public Shape {
+
+public:
+
+    //
+    // Constructors : compresses a built BVH tree, which the caller may delete afterwards
+    //
+    CompressedBVH(const BVH* root);
+
+    virtual ~CompressedBVH() {};
+
+    Hit intersect(Ray ray) const {
+        Hit h;
+        return h;
+    }
+
+    Vec2f getUV(const Hit hit) const {
+        return Vec2f(0, 0);
+    }
+
+    std::string getType() const {
+        return std::string("CompressedBVH");
+    }
+
+    bool hit(const Ray& r, double t_min, double t_max, Hit& rec) const;
+
+    bool occluded(const Ray& r, double t_min, double t_max) const;
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const {
+        output_box = rootBox;
+        return true;
+    }
+
+    //
+    // Memory used by the nodes, in bytes
+    //
+    std::size_t nodeBytes() const {
+        return nodes.size() * sizeof(QuantizedNode);
+    }
+
+private:
+
+    uint32_t encode(const BVH* node, const aabb& box);
+
+    aabb rootBox;
+    std::vector<QuantizedNode> nodes;
+    std::vector<PrimitiveRef> primitives;   // leaf runs, in the order of the nodes
+};
+
+} //namespace rt
+
+
+
+#endif /* COMPRESSEDBVH_H_ */
@@ -8,7 +8,29 @@
 
 namespace rt{
 
+    /**
+     * Constructor of a quad from its corners: v1 and v2 are next to v0, v3 is opposite it
+     *
+     * @param v0 first corner
+     * @param v1 corner next to v0
+     * @param v2 other corner next to v0
+     * @param v3 corner opposite v0
+     * @param type shape id
+     * @param material material of the plane
+     *
+     */
+    Plane::Plane(Vec3f v0, Vec3f v1, Vec3f v2, Vec3f v3, std::string type, Material* material) :
+        v0_1(v0), v1_1(v1), v2_1(v2), v0_2(v3), v1_2(v2), v2_2(v1), type(type), material(material), Shape(material)
+    {
+        // a parallelogram up to the rounding of the scene coordinates
+        Vec3f gap = v1 + v2 - v0 - v3;
+        float size = std::max((v1 - v0).length(), (v2 - v0).length());
+        parallelogram = gap.length() <= 1e-5f * size;
 
+        quad = ParallelogramData(v0, v1, v2);
+        lower = TriangleData(v0, v1, v2);
+        upper = TriangleData(v3, v2, v1);
+    }
 
 } //namespace rt
 
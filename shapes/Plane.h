@@ -11,13 +11,66 @@
 #include "core/RayHitStructs.h"
 #include "core/Shape.h"
 #include "shapes/Triangle.h"
-#include "BVH.h"
+#include <cstdint>
+#include <limits>
 #include <vector>
 #define _USE_MATH_DEFINES  // for MSVC, for M_PI
 #include <math.h>
 
 namespace rt {
 
+    /*
+     * Parallelogram with corner v0 and edges v1 - v0 and v2 - v0, precomputed for the ray test.
+     * A hit is one plane intersection followed by projecting the hit point, relative to v0, on the two
+     * edge duals: (a, b) are its coordinates along the edges, inside the parallelogram when both are in [0, 1].
+     */
+    struct ParallelogramData {
+
+        ParallelogramData() {};
+        ParallelogramData(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2) : v0(v0) {
+            Vec3f e1 = v1 - v0, e2 = v2 - v0;
+            Vec3f n = e1.crossProduct(e2);
+            float area2 = n.norm();
+            projection1 = e2.crossProduct(n) * (1 / area2);
+            projection2 = n.crossProduct(e1) * (1 / area2);
+            normal = n.normalize();
+            offset = normal.dotProduct(v0);
+        };
+
+        //
+        // returns true if the ray hits within [t_min, t_max], with the distance t and the edge coordinates a and b
+        //
+        inline bool intersect(const Ray& ray, float t_min, float t_max, float& t, float& a, float& b) const {
+            float denom = normal.dotProduct(ray.direction);
+
+            // ray parallel to the plane
+            if (fabs(denom) < 1e-8f)
+                return false;
+
+            t = (offset - normal.dotProduct(ray.origin)) / denom;
+            if (!(t >= t_min && t <= t_max))
+                return false;
+
+            Vec3f local = ray.origin + ray.direction * t - v0;
+            a = local.dotProduct(projection1);
+            if (a < 0 || a > 1)
+                return false;
+            b = local.dotProduct(projection2);
+            return b >= 0 && b <= 1;
+        }
+
+        Vec3f v0;
+        Vec3f normal;       // unit length
+        float offset;       // plane equation normal . p = offset
+        Vec3f projection1;  // dual of v1 - v0: a point's coordinate along that edge
+        Vec3f projection2;  // dual of v2 - v0
+    };
+
+    /*
+     * Quad given by a corner v0, the corners v1 and v2 next to it and the opposite corner v3. The usual
+     * parallelogram (v3 = v1 + v2 - v0) is tested natively; other quads keep the original pair of triangles
+     * (v0, v1, v2) and (v3, v2, v1). Hits record which of the two triangles they fall in, for the UV mapping.
+     */
     class Plane : public Shape {
 
     public:
@@ -27,8 +80,7 @@ namespace rt {
         //
         Plane() {};
 
-        Plane(Vec3f v0, Vec3f v1, Vec3f v2, Vec3f v3, std::string type, Material* material) :
-            v0_1(v0), v1_1(v1), v2_1(v2), v0_2(v3), v1_2(v2), v2_2(v1), type(type), material(material), Shape(material) {};//ok 3,2,1 ; 3,1,2
+        Plane(Vec3f v0, Vec3f v1, Vec3f v2, Vec3f v3, std::string type, Material* material);
 
         //
         // Destructor
@@ -40,68 +92,70 @@ namespace rt {
         //
         bool hit(
             const Ray& ray, double t_min, double t_max, Hit& rec) const {
-
-            Hit h = triangleIntersect(ray, v0_1, v1_1, v2_1);
-            Hit h2 = triangleIntersect(ray, v0_2, v1_2, v2_2);
-            if (h.hittable) {
-                rec.shape = std::string("lower triangle");
-                rec.distance = h.distance;
-                Vec3f hitPoint(ray.origin + ray.direction * h.distance);
-                hitPoint = hitPoint.normalize();
-                rec.point = hitPoint;
-                rec.set_face_normal(ray, h.normal);
-                rec.material = material;
-                rec.uv = getUV(h);
-                rec.hittable = true;
-                rec.normal = h.normal;
-                return true;
+            float t;
+            uint32_t half;
+            if (!closestHit(ray, (float)t_min, (float)t_max, t, half)) {
+                rec.hittable = false;
+                return false;
             }
-            else if (h2.hittable) {
-                rec.shape = std::string("upper triangle");
-                rec.distance = h2.distance;
-                Vec3f hitPoint(ray.origin + ray.direction * h2.distance);
-                hitPoint = hitPoint.normalize();
-                rec.point = hitPoint;
-                rec.set_face_normal(ray, h2.normal);
-                rec.material = material;
-                rec.uv = getUV(h2);
-                rec.hittable = true;
-                rec.normal = h2.normal;
-                return true;
+            rec.distance = t;
+            rec.triIndex = half;
+            rec.object = this;
+            rec.hittable = true;
+            return true;
+        }
+
+        //
+        // Surface attributes of a hit found by hit(), on the triangle it recorded
+        //
+        void fill_hit(const Ray& ray, Hit& rec) const {
+            Vec3f N = rec.triIndex == 0 ? (v1_1 - v0_1).crossProduct(v2_1 - v0_1) : (v1_2 - v0_2).crossProduct(v2_2 - v0_2);
+            N.normalize();
+            Vec3f hitPoint(ray.origin + ray.direction * rec.distance);
+            hitPoint = hitPoint.normalize();
+            rec.point = hitPoint;
+            rec.set_face_normal(ray, N);
+            rec.material = material;
+            rec.uv = getUV(rec);
+            rec.normal = N;
+        }
+
+        //
+        // Occlusion test for shadow rays
+        //
+        bool occluded(const Ray& ray, double t_min, double t_max) const {
+            float t;
+            uint32_t half;
+            return closestHit(ray, (float)t_min, (float)t_max, t, half);
+        }
+
+        //
+        // Clip the quad against a split plane for the spatial split builder
+        //
+        void split_bounding_box(int axis, float pos, aabb& left_box, aabb& right_box) const {
+            if (parallelogram) {
+                Vec3f corners[4] = { v0_1, v1_1, v0_2, v2_1 };
+                split_polygon_box(corners, 4, axis, pos, left_box, right_box);
+                return;
             }
-            rec.hittable = false;
-            return false;
+            Vec3f lower[3] = { v0_1, v1_1, v2_1 };
+            Vec3f upper[3] = { v0_2, v1_2, v2_2 };
+            aabb upper_left, upper_right;
+            split_polygon_box(lower, 3, axis, pos, left_box, right_box);
+            split_polygon_box(upper, 3, axis, pos, upper_left, upper_right);
+            left_box.expand(upper_left);
+            right_box.expand(upper_right);
         }
 
         //
-        // Compute bounding box for plane
+        // Compute bounding box for plane, over its four corners
         //
         bool bounding_box(double time0, double time1, aabb& output_box) const {
-            std::vector<Vec3f> vertexCoords;
-            vertexCoords.push_back(v0_1);
-            vertexCoords.push_back(v1_1);
-            vertexCoords.push_back(v2_1);
-
-            // compute bounds
-            Vec3f min = v0_1;
-            Vec3f max = v0_1;
-            for (auto v : vertexCoords) {
-                if (v.x < min.x)
-                    min.x = v.x;
-                if (v.x > max.x)
-                    max.x = v.x;
-
-                if (v.y < min.y)
-                    min.y = v.y;
-                if (v.y > max.y)
-                    max.y = v.y;
-
-                if (v.z < min.z)
-                    min.z = v.z;
-                if (v.z > max.z)
-                    max.z = v.z;
-            }
-            output_box = aabb(min, max);
+            output_box = aabb::empty();
+            output_box.expand(v0_1);
+            output_box.expand(v1_1);
+            output_box.expand(v2_1);
+            output_box.expand(v0_2);
             return true;
         }
 
@@ -122,7 +176,7 @@ namespace rt {
             Vec2f tex;
 
             // position is at lower triangle 
-            if (hit.shape == std::string("lower triangle")) {
+            if (hit.triIndex == 0) {
                 totalArea = getTriangleArea(v0_1, v1_1, v2_1);
                 alpha = getTriangleArea(v1_1, v2_1, hit.point) / totalArea;
                 beta = getTriangleArea(v0_1, hit.point, v2_1) / totalArea;
@@ -164,116 +218,62 @@ namespace rt {
             return ab.crossProduct(ac).length() / 2.0f;
         }
 
-        /**
-         * Computes U and V reflection vectors to map texture image pixels on sphere.
-         * Source: https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/barycentric-coordinates.html,
-         * UV mapping the primitives (page.23).
-         *
-         * @return hit records
-         *
-         */
-        Hit triangleIntersect(Ray ray, Vec3f v0, Vec3f v1, Vec3f v2) const {
+        Hit intersect(Ray ray) const {
             Hit h;
+            if (hit(ray, 0, std::numeric_limits<float>::max(), h))
+                fill_hit(ray, h);
+            return h;
+        };
 
-            // compute the plane's normal
-            Vec3f v0v1 = v1 - v0;
-            Vec3f v0v2 = v2 - v0;
-            // no need to normalize
-            Vec3f N = (v0v1.crossProduct(v0v2)).normalize(); // N
-            float denom = N.dotProduct(N);
-
-            // Step 1: finding P
-
-            // check if the ray and plane are parallel.
-            float NdotRayDirection = N.dotProduct(ray.direction);
-            if (fabs(NdotRayDirection) < 1e-8) {  // they are parallel 
-                h.hittable = false;
-                return h;
-            }
-
-            // compute d parameter using equation 2
-            float d = -N.dotProduct(v0);
+        std::string getType() const {
+            return type;
+        }
 
-            // compute t, distance from ray origin to intersection (equation 3)
-            float t = -(N.dotProduct(ray.origin) + d) / NdotRayDirection;
-            // check if the triangle is behind the ray
-            if (t < 0) {
-                h.hittable = false;
-                return h;
-            }
+        PrimitiveKind getKind() const {
+            return PLANE_PRIMITIVE;
+        }
 
-            // compute the intersection point using equation 1
-            Vec3f P = ray.origin + t * ray.direction;
+        void hash(uint64_t& h) const {
+            Vec3f v[4] = { v0_1, v1_1, v2_1, v0_2 };
+            hash_bytes(h, v, sizeof(v));
+        }
 
-            // Step 2: inside-outside test
-            Vec3f C; // vector perpendicular to triangle's plane
 
-            // edge 0
-            Vec3f edge0 = v1 - v0;
-            Vec3f vp0 = P - v0;
-            C = edge0.crossProduct(vp0);
-            if (N.dotProduct(C) < 0) {
-                // P is on the right side
-                h.hittable = false;
-                return h;
-            }
 
-            // edge 1
-            Vec3f edge1 = v2 - v1;
-            Vec3f vp1 = P - v1;
-            C = edge1.crossProduct(vp1);
-            if ((N.dotProduct(C)) < 0) {
-                // P is on the right side
-                h.hittable = false;
-                return h;
-            }
+    private:
 
-            // edge 2
-            Vec3f edge2 = v0 - v2;
-            Vec3f vp2 = P - v2;
-            C = edge2.crossProduct(vp2);
-            if ((N.dotProduct(C)) < 0) {
-                // P is on the right side
-                h.hittable = false;
-                return h;
+        //
+        // closest hit of the quad within [t_min, t_max], with the triangle it falls in (0 lower, 1 upper)
+        //
+        inline bool closestHit(const Ray& ray, float t_min, float t_max, float& t, uint32_t& half) const {
+            float a, b;
+            if (parallelogram) {
+                if (!quad.intersect(ray, t_min, t_max, t, a, b))
+                    return false;
+                half = a + b <= 1 ? 0 : 1;
+                return true;
             }
-
-            // this ray hits the triangle: store hit elements    
-            h.distance = t;
-            Vec3f hitPoint(ray.origin + ray.direction * t);
-            hitPoint = hitPoint.normalize();
-            h.point = hitPoint;
-            h.normal = N;
-            h.hittable = true;
-
-            return h;
-        };
-
-        Hit intersect(Ray ray) const {
-
-            Hit h = triangleIntersect(ray, v0_1, v1_1, v2_1);
-            Hit h2 = triangleIntersect(ray, v0_2, v1_2, v2_2);
-            if (h.hittable) {
-                h.shape = std::string("lower triangle");
-                return h;
+            bool found = false;
+            float t_upper;
+            if (lower.intersect(ray, t_min, t_max, t, a, b)) {
+                t_max = t;
+                half = 0;
+                found = true;
             }
-            else if (h2.hittable) {
-                h2.shape = std::string("upper triangle");
-                return h2;
+            if (upper.intersect(ray, t_min, t_max, t_upper, a, b)) {
+                t = t_upper;
+                half = 1;
+                found = true;
             }
-            return h;
-        };
-
-        std::string getType() const {
-            return type;
+            return found;
         }
 
-
-
-    private:
         std::string type;
         Vec3f v0_1, v1_1, v2_1;
         Vec3f v0_2, v1_2, v2_2;
+        bool parallelogram;         // v3 = v1 + v2 - v0, tested as quad
+        ParallelogramData quad;
+        TriangleData lower, upper;  // the triangles of other quads
 
         Material* material;
 
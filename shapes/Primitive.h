@@ -0,0 +1,95 @@
+/*
+ * Primitive.h
+ *
+ *
+ */
+
+#ifndef PRIMITIVE_H_
+#define PRIMITIVE_H_
+
+#include "core/Shape.h"
+#include "core/RayHitStructs.h"
+#include "shapes/Sphere.h"
+#include "shapes/Triangle.h"
+#include "shapes/Plane.h"
+#include "shapes/SphereBatch.h"
+#include <cstdint>
+
+namespace rt{
+
+/*
+ * Accelerator reference to a scene shape, tagged with the shape's kind in the low bits of the pointer.
+ * Shapes are 8-byte aligned (they start with a vtable pointer), which leaves room for the 3-bit tag,
+ * so a reference stays pointer sized. The leaves test their primitives through primitive_hit and
+ * primitive_occluded, a switch over the kinds whose calls the compiler resolves and inlines.
+ */
+class PrimitiveRef {
+
+public:
+
+    //
+    // Constructors
+    //
+    PrimitiveRef() : bits(0) {};
+    explicit PrimitiveRef(const Shape* shape) : bits(reinterpret_cast<uintptr_t>(shape) | (uintptr_t)shape->getKind()) {};
+
+    //
+    // Getters
+    //
+    PrimitiveKind kind() const {
+        return (PrimitiveKind)(bits & KIND_MASK);
+    }
+
+    Shape* shape() const {
+        return reinterpret_cast<Shape*>(bits & ~KIND_MASK);
+    }
+
+private:
+    static const uintptr_t KIND_MASK = 7;
+
+    uintptr_t bits;
+};
+
+static_assert(alignof(Shape) >= 8 && PRIMITIVE_KINDS <= 8, "shape pointers need free low bits for the kind tag");
+
+//
+// closest hit test of a referenced shape, without a virtual call for the built-in kinds
+//
+inline bool primitive_hit(PrimitiveRef p, const Ray& r, double t_min, double t_max, Hit& rec) {
+    switch (p.kind()) {
+    case SPHERE_PRIMITIVE:
+        return static_cast<const Sphere*>(p.shape())->Sphere::hit(r, t_min, t_max, rec);
+    case TRIANGLE_PRIMITIVE:
+        return static_cast<const Triangle*>(p.shape())->Triangle::hit(r, t_min, t_max, rec);
+    case PLANE_PRIMITIVE:
+        return static_cast<const Plane*>(p.shape())->Plane::hit(r, t_min, t_max, rec);
+    case SPHERE_BATCH_PRIMITIVE:
+        return static_cast<const SphereBatch*>(p.shape())->SphereBatch::hit(r, t_min, t_max, rec);
+    default:
+        return p.shape()->hit(r, t_min, t_max, rec);
+    }
+}
+
+//
+// any hit test of a referenced shape, for shadow rays
+//
+inline bool primitive_occluded(PrimitiveRef p, const Ray& r, double t_min, double t_max) {
+    switch (p.kind()) {
+    case SPHERE_PRIMITIVE:
+        return static_cast<const Sphere*>(p.shape())->Sphere::occluded(r, t_min, t_max);
+    case TRIANGLE_PRIMITIVE:
+        return static_cast<const Triangle*>(p.shape())->Triangle::occluded(r, t_min, t_max);
+    case PLANE_PRIMITIVE:
+        return static_cast<const Plane*>(p.shape())->Plane::occluded(r, t_min, t_max);
+    case SPHERE_BATCH_PRIMITIVE:
+        return static_cast<const SphereBatch*>(p.shape())->SphereBatch::occluded(r, t_min, t_max);
+    default:
+        return p.shape()->occluded(r, t_min, t_max);
+    }
+}
+
+} //namespace rt
+
+
+
+#endif /* PRIMITIVE_H_ */
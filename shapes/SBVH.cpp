@@ -0,0 +1,420 @@
+/*
+ * SBVH.cpp
+ *
+ *
+ */
+#include "SBVH.h"
+#include <algorithm>
+
+namespace rt{
+
+namespace {
+
+    float boxArea(const aabb& box) {
+        return box.is_empty() ? 0.0f : (float)box.area();
+    }
+
+    float centroid(const aabb& box, int axis) {
+        return 0.5f * (box.minimum[axis] + box.maximum[axis]);
+    }
+
+} // namespace
+
+    /**
+     * Constructor
+     *
+     * @param shapes the scene shapes
+     * @param splitBudget extra references allowed by spatial splits, as a fraction of the shape count
+     * @param maxLeafSize most references in a leaf
+     *
+     */
+    SBVHBuilder::SBVHBuilder(const std::vector<Shape*>& shapes, float splitBudget, int maxLeafSize) :
+        shapes(shapes), numReferences(0), maxLeafSize((std::size_t)std::max(maxLeafSize, 1)), minOverlap(0)
+    {
+        maxReferences = shapes.size() + (std::size_t)(std::max(splitBudget, 0.0f) * shapes.size());
+    }
+
+    /**
+     * Builds the tree over all shapes
+     *
+     * @param arena node storage, cleared and sized for the tree
+     *
+     * @return root node of the BVH tree
+     *
+     */
+    BVH* SBVHBuilder::build(BVHArena& arena)
+    {
+        // the live references never outnumber those made, so the array never grows past the budget
+        refs.clear();
+        refs.reserve(maxReferences);
+        rightArea.resize(maxReferences);
+        aabb bounds = aabb::empty();
+        for (std::size_t i = 0; i < shapes.size(); ++i) {
+            Reference ref;
+            ref.shape = shapes[i];
+            ref.index = (uint32_t)i;
+            shapes[i]->bounding_box(0, 0, ref.box);
+            bounds.expand(ref.box);
+            refs.push_back(ref);
+        }
+        numReferences = refs.size();
+
+        // spatial splits only pay off where the object split children overlap noticeably
+        minOverlap = 1e-5f * boxArea(bounds);
+
+        // every reference is in a leaf, so the tree has at most maxReferences - 1 inner nodes
+        arena.reserve(BVHArena::maxNodes(maxReferences), maxReferences);
+
+        BVH* root = arena.allocate();
+        if (refs.size() == 1) {
+            root->set_child(0, makeRun(0, arena), 1);
+            root->set_child(1, nullptr, 0);
+            root->box = bounds;
+        }
+        else {
+            buildNode(root, 0, bounds, 0, arena);
+        }
+        return root;
+    }
+
+    /**
+     * Builds the subtree over the references from begin to the end of the array, and drops them
+     *
+     * @param node the subtree root
+     * @param begin first reference of the node, at least two
+     * @param bounds bounds of the references
+     * @param depth node depth
+     * @param arena node and leaf storage
+     *
+     */
+    void SBVHBuilder::buildNode(BVH* node, std::size_t begin, const aabb& bounds, int depth, BVHArena& arena)
+    {
+        std::size_t count = refs.size() - begin;
+        std::size_t rightCount = 0;
+        int axis = 0;
+
+        // deep subtree: halve by count so the depth stays within the traversal stack
+        bool halve = depth >= BVH_STACK_SIZE / 2;
+        if (!halve) {
+            Split objectSplit;
+            objectSplit.cost = std::numeric_limits<float>::infinity();
+            findObjectSplit(begin, objectSplit);
+
+            Split spatialSplit;
+            spatialSplit.cost = objectSplit.cost;
+            aabb overlap = intersect_boxes(objectSplit.leftBox, objectSplit.rightBox);
+            if (numReferences < maxReferences && boxArea(overlap) > minOverlap)
+                findSpatialSplit(begin, bounds, spatialSplit);
+
+            axis = objectSplit.axis;
+            if (spatialSplit.spatial) {
+                rightCount = performSpatialSplit(begin, spatialSplit);
+                axis = spatialSplit.axis;
+            }
+
+            // object split, also taken when unsplitting emptied one side of the spatial split;
+            // no reference was split then, so the array only needs sorting again
+            if (rightCount == 0 || rightCount == refs.size() - begin) {
+                axis = objectSplit.axis;
+                if (spatialSplit.spatial)
+                    sortReferences(begin, axis);
+                std::rotate(refs.begin() + begin, refs.begin() + begin + objectSplit.leftCount, refs.end());
+                rightCount = count - objectSplit.leftCount;
+            }
+
+            // no split was chosen, as when every cost is NaN on degenerate boxes: halve by count too
+            halve = rightCount == 0 || rightCount == count;
+        }
+        if (halve) {
+            axis = bounds.longest_axis();
+            sortReferences(begin, axis);
+            std::size_t mid = count / 2;
+            std::rotate(refs.begin() + begin, refs.begin() + begin + mid, refs.end());
+            rightCount = count - mid;
+        }
+
+        node->box = bounds;
+        node->axis = axis;
+
+        // the left child's references are on the tail, so it is built first
+        buildChild(node, 0, begin + rightCount, bounds, depth, arena);
+        buildChild(node, 1, begin, bounds, depth, arena);
+    }
+
+    /**
+     * Makes child c of a node, a leaf or a subtree, over the references from begin to the end of the array,
+     * and drops them
+     *
+     * @param node the parent node
+     * @param c child slot, 0 left, 1 right
+     * @param begin first reference of the child
+     * @param parentBounds bounds of the parent's references
+     * @param depth parent depth
+     * @param arena node and leaf storage
+     *
+     */
+    void SBVHBuilder::buildChild(BVH* node, int c, std::size_t begin, const aabb& parentBounds, int depth, BVHArena& arena)
+    {
+        aabb bounds = aabb::empty();
+        std::size_t count = refs.size() - begin, spheres = 0;
+        for (std::size_t i = begin; i < refs.size(); ++i) {
+            bounds.expand(refs[i].box);
+            if (refs[i].shape->getKind() == SPHERE_PRIMITIVE) spheres++;
+        }
+
+        if (count <= maxLeafSize
+            && (count == 1 || bvh_leaf_is_cheaper(bvh_leaf_test_cost(count, spheres), boxArea(parentBounds), boxArea(bounds)))) {
+            node->set_child(c, makeRun(begin, arena), (int)count);
+        }
+        else {
+            // taken before its children so the nodes are laid out depth first
+            BVH* child = arena.allocate();
+            node->set_child(c, child);
+            buildNode(child, begin, bounds, depth + 1, arena);
+        }
+        refs.erase(refs.begin() + begin, refs.end());
+    }
+
+    /**
+     * Stores the shapes of the references from begin to the end of the array as a leaf run
+     *
+     * @param begin first reference of the leaf
+     * @param arena leaf storage
+     *
+     * @return the run
+     *
+     */
+    const PrimitiveRef* SBVHBuilder::makeRun(std::size_t begin, BVHArena& arena) const
+    {
+        PrimitiveRef* run = arena.allocatePrimitives(refs.size() - begin);
+        for (std::size_t i = begin; i < refs.size(); ++i)
+            run[i - begin] = PrimitiveRef(refs[i].shape);
+        return run;
+    }
+
+    /**
+     * Sorts the references from begin to the end of the array by centroid, then by shape
+     *
+     * @param begin first reference
+     * @param axis sort axis
+     *
+     */
+    void SBVHBuilder::sortReferences(std::size_t begin, int axis)
+    {
+        std::sort(refs.begin() + begin, refs.end(), [axis](const Reference& a, const Reference& b) {
+            float ca = centroid(a.box, axis), cb = centroid(b.box, axis);
+            return ca < cb || (ca == cb && a.index < b.index);
+        });
+    }
+
+    /**
+     * Finds the SAH-cheapest object split by sweeping the references sorted by centroid on each axis.
+     * Leaves the references sorted along the chosen axis.
+     *
+     * @param begin first reference of the node
+     * @param split the best split found
+     *
+     */
+    void SBVHBuilder::findObjectSplit(std::size_t begin, Split& split)
+    {
+        std::size_t n = refs.size() - begin;
+        const Reference* node = refs.data() + begin;
+
+        for (int axis = 0; axis < 3; axis++) {
+            sortReferences(begin, axis);
+
+            aabb box = aabb::empty();
+            for (std::size_t i = n - 1; i > 0; i--) {
+                box.expand(node[i].box);
+                rightArea[i] = boxArea(box);
+            }
+
+            box = aabb::empty();
+            for (std::size_t i = 1; i < n; i++) {
+                box.expand(node[i - 1].box);
+                float cost = boxArea(box) * i + rightArea[i] * (n - i);
+                if (cost < split.cost) {
+                    split.cost = cost;
+                    split.axis = axis;
+                    split.leftCount = i;
+                }
+            }
+        }
+
+        sortReferences(begin, split.axis);
+        split.leftBox = aabb::empty();
+        split.rightBox = aabb::empty();
+        for (std::size_t i = 0; i < n; i++) {
+            (i < split.leftCount ? split.leftBox : split.rightBox).expand(node[i].box);
+        }
+    }
+
+    /**
+     * Finds the SAH-cheapest spatial split plane among evenly spaced bins on each axis.
+     * References are clipped into every bin they overlap.
+     *
+     * @param begin first reference of the node
+     * @param bounds bounds of the references
+     * @param split updated if a spatial split is cheaper than its current cost
+     *
+     */
+    void SBVHBuilder::findSpatialSplit(std::size_t begin, const aabb& bounds, Split& split)
+    {
+        std::size_t n = refs.size() - begin;
+        for (int axis = 0; axis < 3; axis++) {
+            float origin = bounds.minimum[axis];
+            float binWidth = (bounds.maximum[axis] - origin) / SPATIAL_BINS;
+            if (binWidth <= 0)
+                continue;
+            float invWidth = 1.0f / binWidth;
+
+            aabb binBox[SPATIAL_BINS];
+            std::size_t enter[SPATIAL_BINS] = { 0 }, exit[SPATIAL_BINS] = { 0 };
+            for (int b = 0; b < SPATIAL_BINS; b++) binBox[b] = aabb::empty();
+
+            for (std::size_t i = begin; i < refs.size(); ++i) {
+                const Reference& ref = refs[i];
+                int first = std::min(std::max((int)((ref.box.minimum[axis] - origin) * invWidth), 0), SPATIAL_BINS - 1);
+                int last = std::min(std::max((int)((ref.box.maximum[axis] - origin) * invWidth), first), SPATIAL_BINS - 1);
+
+                // chop the reference at each bin boundary it crosses
+                Reference rest = ref;
+                for (int b = first; b < last; b++) {
+                    Reference leftPart, rightPart;
+                    splitReference(rest, axis, origin + binWidth * (b + 1), leftPart, rightPart);
+                    binBox[b].expand(leftPart.box);
+                    rest = rightPart;
+                }
+                binBox[last].expand(rest.box);
+                enter[first]++;
+                exit[last]++;
+            }
+
+            aabb rightBoxes[SPATIAL_BINS];
+            aabb box = aabb::empty();
+            for (int b = SPATIAL_BINS - 1; b > 0; b--) {
+                box.expand(binBox[b]);
+                rightBoxes[b] = box;
+            }
+
+            aabb leftBox = aabb::empty();
+            std::size_t leftCount = 0, rightCount = n;
+            for (int b = 0; b < SPATIAL_BINS - 1; b++) {
+                leftBox.expand(binBox[b]);
+                leftCount += enter[b];
+                rightCount -= exit[b];
+                if (leftCount == 0 || rightCount == 0)
+                    continue;
+
+                float cost = boxArea(leftBox) * leftCount + boxArea(rightBoxes[b + 1]) * rightCount;
+                if (cost < split.cost) {
+                    split.cost = cost;
+                    split.axis = axis;
+                    split.spatial = true;
+                    split.position = origin + binWidth * (b + 1);
+                    split.leftBox = leftBox;
+                    split.rightBox = rightBoxes[b + 1];
+                    split.spatialLeft = leftCount;
+                    split.spatialRight = rightCount;
+                }
+            }
+        }
+    }
+
+    /**
+     * Splits a reference in two at a plane, clipping the shape against it
+     *
+     * @param ref the reference to split
+     * @param axis plane axis
+     * @param pos plane position
+     * @param left part below the plane (empty box if none)
+     * @param right part above the plane (empty box if none)
+     *
+     */
+    void SBVHBuilder::splitReference(const Reference& ref, int axis, float pos, Reference& left, Reference& right) const
+    {
+        aabb leftBox, rightBox;
+        ref.shape->split_bounding_box(axis, pos, leftBox, rightBox);
+
+        left.shape = right.shape = ref.shape;
+        left.index = right.index = ref.index;
+        left.box = intersect_boxes(leftBox, ref.box);
+        left.box.maximum[axis] = fmin(left.box.maximum[axis], pos);
+        right.box = intersect_boxes(rightBox, ref.box);
+        right.box.minimum[axis] = fmax(right.box.minimum[axis], pos);
+    }
+
+    /**
+     * Distributes the references to the children of a spatial split, in place: the right child's references
+     * are moved to the front of the node's range, the left child's stay behind them, and the left parts of
+     * split references are appended.
+     * A straddling reference is moved whole to one side when that is cheaper than duplicating it
+     * (reference unsplitting), or when the split budget is used up.
+     *
+     * @param begin first reference of the node
+     * @param split the spatial split
+     *
+     * @return the number of references of the right child
+     */
+    std::size_t SBVHBuilder::performSpatialSplit(std::size_t begin, const Split& split)
+    {
+        int axis = split.axis;
+        float pos = split.position;
+        aabb leftBox = split.leftBox, rightBox = split.rightBox;
+        float leftCount = (float)split.spatialLeft, rightCount = (float)split.spatialRight;
+
+        // [begin, right) holds the right child's references so far, [right, i) the left child's
+        std::size_t right = begin, end = refs.size();
+        for (std::size_t i = begin; i < end; ++i) {
+            Reference ref = refs[i];
+            bool toRight;
+            if (ref.box.maximum[axis] <= pos) {
+                toRight = false;
+            }
+            else if (ref.box.minimum[axis] >= pos) {
+                toRight = true;
+            }
+            else {
+                aabb leftUnion = leftBox, rightUnion = rightBox;
+                leftUnion.expand(ref.box);
+                rightUnion.expand(ref.box);
+                float splitCost = boxArea(leftBox) * leftCount + boxArea(rightBox) * rightCount;
+                float leftCost = boxArea(leftUnion) * leftCount + boxArea(rightBox) * (rightCount - 1);
+                float rightCost = boxArea(leftBox) * (leftCount - 1) + boxArea(rightUnion) * rightCount;
+                if (numReferences >= maxReferences)
+                    splitCost = std::numeric_limits<float>::infinity();
+
+                if (leftCost < splitCost && leftCost <= rightCost) {
+                    toRight = false;
+                    leftBox = leftUnion;
+                    rightCount -= 1;
+                }
+                else if (rightCost < splitCost) {
+                    toRight = true;
+                    rightBox = rightUnion;
+                    leftCount -= 1;
+                }
+                else {
+                    Reference leftPart, rightPart;
+                    splitReference(ref, axis, pos, leftPart, rightPart);
+                    if (leftPart.box.is_empty()) {
+                        toRight = true;
+                    }
+                    else if (rightPart.box.is_empty()) {
+                        toRight = false;
+                    }
+                    else {
+                        refs[i] = rightPart;
+                        refs.push_back(leftPart);
+                        numReferences++;
+                        toRight = true;
+                    }
+                }
+            }
+            if (toRight)
+                std::swap(refs[right++], refs[i]);
+        }
+        return right - begin;
+    }
+
+} //namespace rt
@@ -0,0 +1,87 @@
+/*
+ * SBVH.h
+ *
+ *
+ */
+
+#ifndef SBVH_H_
+#define SBVH_H_
+
+#include "core/Shape.h"
+#include "shapes/BVH.h"
+#include <vector>
+
+namespace rt{
+
+/*
+ * Spatial split BVH builder
+ * Source: Stich et al., "Spatial Splits in Bounding Volume Hierarchies", HPG 2009
+ *
+ * Each node takes the cheaper (SAH) of the best object split and the best spatial split. A spatial split
+ * cuts the references straddling a plane into clipped halves, so large shapes such as walls no longer
+ * inflate the boxes near the root. The number of duplicated references is bounded by the split budget.
+ * A child of at most maxLeafSize references becomes a leaf when the SAH finds that cheaper.
+ *
+ * The references live in one array, reserved for the split budget up front. A node works on the tail of the
+ * array and splits it in place, the right child's references first and the left child's at the end, where
+ * spatial splits append their extra parts; the left child is built on the tail, then the right one, each
+ * dropping its references when done. So the build allocates nothing per node.
+ */
+class SBVHBuilder {
+
+public:
+
+    //
+    // Constructor
+    //
+    SBVHBuilder(const std::vector<Shape*>& shapes, float splitBudget, int maxLeafSize);
+
+    //
+    // build function : returns the root node of the tree, allocated with its nodes from the arena
+    //
+    BVH* build(BVHArena& arena);
+
+private:
+
+    // part of a shape bounded by box; a shape split by spatial splits has several references
+    struct Reference {
+        Shape* shape;
+        aabb box;
+        uint32_t index;     // of the shape, to order references with equal centroids the same way every build
+    };
+
+    struct Split {
+        float cost;
+        int axis = 0;
+        bool spatial = false;
+        std::size_t leftCount = 0;  // object split: references before the split after sorting
+        float position = 0;         // spatial split: plane position
+        aabb leftBox, rightBox;
+        std::size_t spatialLeft = 0, spatialRight = 0;
+    };
+
+    static const int SPATIAL_BINS = 32;
+
+    void buildNode(BVH* node, std::size_t begin, const aabb& bounds, int depth, BVHArena& arena);
+    void buildChild(BVH* node, int c, std::size_t begin, const aabb& parentBounds, int depth, BVHArena& arena);
+    const PrimitiveRef* makeRun(std::size_t begin, BVHArena& arena) const;
+    void sortReferences(std::size_t begin, int axis);
+    void findObjectSplit(std::size_t begin, Split& split);
+    void findSpatialSplit(std::size_t begin, const aabb& bounds, Split& split);
+    void splitReference(const Reference& ref, int axis, float pos, Reference& left, Reference& right) const;
+    std::size_t performSpatialSplit(std::size_t begin, const Split& split);
+
+    const std::vector<Shape*>& shapes;  // the scene shapes, which outlive the builder
+    std::vector<Reference> refs;        // the references of the nodes still to build, the current one last
+    std::vector<float> rightArea;       // object split sweep scratch
+    std::size_t maxReferences;
+    std::size_t numReferences;
+    std::size_t maxLeafSize;
+    float minOverlap;           // overlap area below which spatial splits are not tried
+};
+
+} //namespace rt
+
+
+
+#endif /* SBVH_H_ */
@@ -10,7 +10,6 @@
 #include "math/geometry.h"
 #include "core/RayHitStructs.h"
 #include "core/Shape.h"
-#include "BVH.h"
 #define _USE_MATH_DEFINES  // for MSVC, for M_PI
 #include <math.h>
 
@@ -70,7 +69,7 @@ public:
 			h.point = hitPoint;
 			Vec3f outward_normal = (h.point - center) * (1 / radius);
 			h.set_face_normal(ray, outward_normal);
-			h.shape = std::string("shape");
+			h.object = this;
 			h.hittable = true;	
 			h.normal = (hitPoint - center).normalize();
 
@@ -98,6 +97,26 @@ public:
 		return this->type;
 	}
 
+	PrimitiveKind getKind() const {
+		return SPHERE_PRIMITIVE;
+	}
+
+	void hash(uint64_t& h) const {
+		hash_bytes(h, &center, sizeof(center));
+		hash_bytes(h, &radius, sizeof(radius));
+	}
+
+	//
+	// Getters
+	//
+	const Vec3f& getCenter() const {
+		return center;
+	}
+
+	float getRadius() const {
+		return radius;
+	}
+
 	//
 	// Intersection test function for BVH version: returns true if ray hits any object, false otherwise
 	//
@@ -105,9 +124,9 @@ public:
 	    const Ray& r, double t_min, double t_max, Hit& rec) const {
 	    Vec3f oc = r.origin - center;
 	        
-	    auto a = r.direction.length() * r.direction.length(); 
+	    auto a = r.direction.norm();
 	    auto half_b = oc.dotProduct(r.direction);
-	    auto c = (oc.length() * oc.length()) - radius * radius; 
+	    auto c = oc.norm() - radius * radius;
 
 	    auto discriminant = half_b * half_b - a * c;
 		if (discriminant < 0) {
@@ -128,20 +147,49 @@ public:
 
 		// store records
 	    rec.distance = root;  
-		Vec3f hitPoint(oc + r.direction * root);
+		rec.object = this;
+		rec.hittable = true;
+
+	    return true;
+	}
+
+	//
+	// Surface attributes of a hit found by hit()
+	//
+	void fill_hit(const Ray& r, Hit& rec) const {
+		Vec3f oc = r.origin - center;
+		Vec3f hitPoint(oc + r.direction * rec.distance);
 		hitPoint = hitPoint.normalize();
 		rec.point = hitPoint; //oc + rec.distance * r.direction; 
 	    Vec3f outward_normal = (rec.point - center) * (1 / radius);
 	    rec.set_face_normal(r, outward_normal);
-		rec.shape = std::string("shape");
-		rec.hittable = true;
 		rec.normal = (rec.point - center).normalize();
 		rec.material = material;
 		rec.uv = getUV(rec);
-
-	    return true;
 	}
 	
+	//
+	// Occlusion test for shadow rays: only checks for a root within [t_min, t_max]
+	//
+	bool occluded(const Ray& r, double t_min, double t_max) const {
+		Vec3f oc = r.origin - center;
+
+		auto a = r.direction.norm();
+		auto half_b = oc.dotProduct(r.direction);
+		auto c = oc.norm() - radius * radius;
+
+		auto discriminant = half_b * half_b - a * c;
+		if (discriminant < 0)
+			return false;
+		auto sqrtd = sqrt(discriminant);
+
+		auto root = (-half_b - sqrtd) / a;
+		if (root >= t_min && root <= t_max)
+			return true;
+		root = (-half_b + sqrtd) / a;
+		return root >= t_min && root <= t_max;
+	}
+
 	//
 	// Compute bounding box for sphere
 	//
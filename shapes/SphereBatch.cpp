@@ -0,0 +1,249 @@
+/*
+ * SphereBatch.cpp
+ *
+ *
+ */
+#include "SphereBatch.h"
+#include "BVH.h"
+#include <limits>
+#include <utility>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace rt{
+
+namespace {
+
+#ifdef __AVX2__
+    /*
+     * 8-wide sphere test with the same operations, in the same order, as Sphere::hit, so both find the same
+     * roots: returns the mask of the lanes hit within [t_min, t_max], with the nearest such root of every lane
+     */
+    inline __m256 intersectLanes(const float* cx, const float* cy, const float* cz, const float* radius2,
+        const __m256 origin[3], const __m256 direction[3], __m256 a, __m256 t_min, __m256 t_max, __m256& t) {
+        __m256 ocx = _mm256_sub_ps(origin[0], _mm256_loadu_ps(cx));
+        __m256 ocy = _mm256_sub_ps(origin[1], _mm256_loadu_ps(cy));
+        __m256 ocz = _mm256_sub_ps(origin[2], _mm256_loadu_ps(cz));
+
+        __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, direction[0]), _mm256_mul_ps(ocy, direction[1])),
+            _mm256_mul_ps(ocz, direction[2]));
+        __m256 norm = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+        __m256 c = _mm256_sub_ps(norm, _mm256_loadu_ps(radius2));
+
+        // a negative discriminant gives a NaN root, which fails the range tests
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 minus_b = _mm256_xor_ps(half_b, _mm256_set1_ps(-0.0f));
+
+        __m256 nearRoot = _mm256_div_ps(_mm256_sub_ps(minus_b, sqrtd), a);
+        __m256 farRoot = _mm256_div_ps(_mm256_add_ps(minus_b, sqrtd), a);
+        __m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(nearRoot, t_min, _CMP_GE_OQ), _mm256_cmp_ps(nearRoot, t_max, _CMP_LE_OQ));
+        __m256 farOk = _mm256_and_ps(_mm256_cmp_ps(farRoot, t_min, _CMP_GE_OQ), _mm256_cmp_ps(farRoot, t_max, _CMP_LE_OQ));
+
+        t = _mm256_blendv_ps(farRoot, nearRoot, nearOk);
+        return _mm256_or_ps(nearOk, farOk);
+    }
+
+    // minimum of the 8 lanes, in every lane
+    inline __m256 horizontalMin(__m256 x) {
+        x = _mm256_min_ps(x, _mm256_permute2f128_ps(x, x, 1));
+        x = _mm256_min_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm256_min_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+#endif
+
+    int sphereCount(const PrimitiveRef* run, int count) {
+        int spheres = 0;
+        for (int k = 0; k < count; k++)
+            if (run[k].kind() == SPHERE_PRIMITIVE) spheres++;
+        return spheres;
+    }
+
+} // namespace
+
+    /**
+     * Constructor of an empty batch
+     */
+    SphereBatch::SphereBatch() : count(0)
+    {
+        for (int lane = 0; lane < WIDTH; lane++) {
+            cx[lane] = cy[lane] = cz[lane] = 0;
+            radius2[lane] = -std::numeric_limits<float>::infinity();
+            spheres[lane] = nullptr;
+        }
+    }
+
+    /**
+     * Adds a sphere to the next free lane
+     *
+     * @param sphere the sphere, which must outlive the batch
+     *
+     */
+    void SphereBatch::add(const Sphere* sphere)
+    {
+        const Vec3f& center = sphere->getCenter();
+        float radius = sphere->getRadius();
+        cx[count] = center.x;
+        cy[count] = center.y;
+        cz[count] = center.z;
+        radius2[count] = radius * radius;
+        spheres[count] = sphere;
+        count++;
+    }
+
+    /**
+     * Test the intersection with all the spheres of the batch at once
+     *
+     * @param r ray
+     * @param t_min min distance
+     * @param t_max max distance
+     * @param rec hit records, with the closest sphere as the hit object
+     *
+     * @return true if ray hits a sphere of the batch, false otherwise
+     */
+    bool SphereBatch::hit(const Ray& r, double t_min, double t_max, Hit& rec) const
+    {
+#ifdef __AVX2__
+        __m256 origin[3], direction[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = _mm256_set1_ps(r.origin[a]);
+            direction[a] = _mm256_set1_ps(r.direction[a]);
+        }
+        __m256 t;
+        __m256 mask = intersectLanes(cx, cy, cz, radius2, origin, direction, _mm256_set1_ps(r.direction.norm()),
+            _mm256_set1_ps((float)t_min), _mm256_set1_ps((float)t_max), t);
+        if (_mm256_movemask_ps(mask) == 0) {
+            rec.hittable = false;
+            return false;
+        }
+
+        // closest lane
+        __m256 hits = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, mask);
+        __m256 closest = horizontalMin(hits);
+        int lanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(hits, closest, _CMP_EQ_OQ)));
+        int lane = 0;
+        while (!(lanes & (1 << lane))) lane++;
+
+        rec.distance = _mm256_cvtss_f32(closest);
+        rec.object = spheres[lane];
+        rec.hittable = true;
+        return true;
+#else
+        bool hit_anything = false;
+        for (int lane = 0; lane < count; lane++) {
+            if (spheres[lane]->Sphere::hit(r, t_min, t_max, rec)) {
+                hit_anything = true;
+                t_max = rec.distance;
+            }
+        }
+        rec.hittable = hit_anything;
+        return hit_anything;
+#endif
+    }
+
+    /**
+     * Test the occlusion by any sphere of the batch
+     *
+     * @param r shadow ray
+     * @param t_min min distance
+     * @param t_max max distance, usually the distance to the light
+     *
+     * @return true if any sphere hits the ray within [t_min, t_max]
+     */
+    bool SphereBatch::occluded(const Ray& r, double t_min, double t_max) const
+    {
+#ifdef __AVX2__
+        __m256 origin[3], direction[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = _mm256_set1_ps(r.origin[a]);
+            direction[a] = _mm256_set1_ps(r.direction[a]);
+        }
+        __m256 t;
+        return _mm256_movemask_ps(intersectLanes(cx, cy, cz, radius2, origin, direction, _mm256_set1_ps(r.direction.norm()),
+            _mm256_set1_ps((float)t_min), _mm256_set1_ps((float)t_max), t)) != 0;
+#else
+        for (int lane = 0; lane < count; lane++) {
+            if (spheres[lane]->Sphere::occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+#endif
+    }
+
+    /**
+     * Bounding box of the spheres of the batch
+     */
+    bool SphereBatch::bounding_box(double time0, double time1, aabb& output_box) const
+    {
+        output_box = aabb::empty();
+        for (int lane = 0; lane < count; lane++) {
+            aabb box;
+            spheres[lane]->bounding_box(time0, time1, box);
+            output_box.expand(box);
+        }
+        return count > 0;
+    }
+
+    /**
+     * Replaces the spheres of every leaf run holding two or more by batches. The new runs, the other
+     * primitives followed by the batches, are allocated from the arena of the tree.
+     *
+     * @param root root node of the BVH tree
+     * @param arena arena of the tree
+     *
+     */
+    void SphereBatches::batch(BVH* root, BVHArena& arena)
+    {
+        // leaves to batch, counting the batches first so the storage never moves
+        std::vector<std::pair<BVH*, int>> leaves;
+        std::size_t total = 0;
+        std::vector<BVH*> pending(1, root);
+        while (!pending.empty()) {
+            BVH* node = pending.back();
+            pending.pop_back();
+            for (int c = 0; c < 2; c++) {
+                if (node->child_is_node(c)) {
+                    pending.push_back(node->child_node(c));
+                    continue;
+                }
+                int spheres = sphereCount(node->child_run(c), node->child_count(c));
+                if (spheres < 2)
+                    continue;
+                leaves.push_back(std::make_pair(node, c));
+                total += (spheres + SphereBatch::WIDTH - 1) / SphereBatch::WIDTH;
+            }
+        }
+
+        batches.clear();
+        batches.reserve(total);
+        for (const std::pair<BVH*, int>& leaf : leaves) {
+            BVH* node = leaf.first;
+            int c = leaf.second;
+            const PrimitiveRef* run = node->child_run(c);
+            int count = node->child_count(c);
+            int spheres = sphereCount(run, count);
+            int runBatches = (spheres + SphereBatch::WIDTH - 1) / SphereBatch::WIDTH;
+
+            PrimitiveRef* batched = arena.allocatePrimitives(count - spheres + runBatches);
+            int n = 0;
+            SphereBatch* current = nullptr;
+            for (int k = 0; k < count; k++) {
+                if (run[k].kind() != SPHERE_PRIMITIVE) {
+                    batched[n++] = run[k];
+                    continue;
+                }
+                if (current == nullptr || current->size() == SphereBatch::WIDTH) {
+                    batches.emplace_back();
+                    current = &batches.back();
+                }
+                current->add(static_cast<const Sphere*>(run[k].shape()));
+            }
+            for (std::size_t b = batches.size() - runBatches; b < batches.size(); b++)
+                batched[n++] = PrimitiveRef(&batches[b]);
+            node->set_child(c, batched, n);
+        }
+    }
+
+} //namespace rt
@@ -0,0 +1,114 @@
+/*
+ * SphereBatch.h
+ *
+ *
+ */
+
+#ifndef SPHEREBATCH_H_
+#define SPHEREBATCH_H_
+
+#include "core/Shape.h"
+#include "core/RayHitStructs.h"
+#include "shapes/Sphere.h"
+#include <vector>
+
+namespace rt{
+
+class BVH;
+class BVHArena;
+
+/*
+ * Up to 8 spheres of a BVH leaf, stored as SoA lanes (center and squared radius) so one 8-wide evaluation
+ * of the quadratic tests a ray against all of them. The batch stands in for its spheres in the leaf run and
+ * reports the closest one as the hit object, whose fill_hit computes the surface attributes as usual.
+ * Lanes past the last sphere have a squared radius of -inf, which gives no real root.
+ */
+class SphereBatch :public Shape {
+
+public:
+
+    static const int WIDTH = 8;
+
+    //
+    // Constructors
+    //
+    SphereBatch();
+
+    virtual ~SphereBatch() {};
+
+    //
+    // adds a sphere to the next free lane
+    //
+    void add(const Sphere* sphere);
+
+    Hit intersect(Ray ray) const {
+        Hit h;
+        return h;
+    }
+
+    Vec2f getUV(const Hit hit) const {
+        return Vec2f(0, 0);
+    }
+
+    std::string getType() const {
+        return std::string("SphereBatch");
+    }
+
+    PrimitiveKind getKind() const {
+        return SPHERE_BATCH_PRIMITIVE;
+    }
+
+    bool hit(const Ray& r, double t_min, double t_max, Hit& rec) const;
+
+    bool occluded(const Ray& r, double t_min, double t_max) const;
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const;
+
+    //
+    // Getters
+    //
+    int size() const {
+        return count;
+    }
+
+private:
+
+    float cx[WIDTH];
+    float cy[WIDTH];
+    float cz[WIDTH];
+    float radius2[WIDTH];
+    const Sphere* spheres[WIDTH];
+    int count;
+};
+
+/*
+ * Sphere batches of a BVH tree.
+ * Built once the tree is final: every leaf run holding two spheres or more is rewritten, in the tree's arena,
+ * with its spheres replaced by batches of up to 8. The batches are kept here and must outlive the tree
+ * (or the compressed tree made from it).
+ */
+class SphereBatches {
+
+public:
+
+    //
+    // batches the spheres of every leaf of the tree under root
+    //
+    void batch(BVH* root, BVHArena& arena);
+
+    //
+    // number of batches made
+    //
+    std::size_t size() const {
+        return batches.size();
+    }
+
+private:
+    std::vector<SphereBatch> batches;   // reserved up front, the leaf runs point into it
+};
+
+} //namespace rt
+
+
+
+#endif /* SPHEREBATCH_H_ */
@@ -0,0 +1,334 @@
+/*
+ * TreeletOptimizer.cpp
+ *
+ *
+ */
+#include "TreeletOptimizer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <thread>
+#include <utility>
+
+namespace rt{
+
+namespace {
+
+    // restructuring may deepen a subtree only while its leaves stay within this depth
+    const int HEIGHT_LIMIT = BVH_STACK_SIZE / 2;
+
+    // treelet leaf: an inner node, kept with its subtree, or a run of primitives
+    struct TreeletLeaf {
+        BVH* node;              // nullptr for a run
+        const PrimitiveRef* run;
+        int count;
+        aabb box;
+        double cost;
+        int height;
+    };
+
+    int lowestBit(unsigned set) {
+        int i = 0;
+        while (!(set & (1u << i))) i++;
+        return i;
+    }
+
+    // split axis of a rebuilt node: the axis that separates the child boxes most, for the traversal order
+    int separatingAxis(const aabb& a, const aabb& b) {
+        int axis = 0;
+        float best = -1;
+        for (int i = 0; i < 3; i++) {
+            float d = std::abs((a.minimum[i] + a.maximum[i]) - (b.minimum[i] + b.maximum[i]));
+            if (d > best) {
+                best = d;
+                axis = i;
+            }
+        }
+        return axis;
+    }
+
+} // namespace
+
+    /**
+     * Runs the restructuring passes over the tree
+     *
+     * @param root root node of the BVH tree
+     *
+     */
+    void TreeletOptimizer::optimize(BVH* root)
+    {
+        if (passes <= 0 || root->has_single_child())
+            return;
+
+        measure(root);
+        double rootArea = root->box.area() > 0 ? root->box.area() : 1.0;
+        double before = info.find(root)->second.cost;
+
+        unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+        for (int pass = 0; pass < passes; pass++) {
+            if (pass > 0) measure(root);
+
+            // split the tree into disjoint subtrees, enough to keep every thread busy, and the nodes above them
+            std::vector<BVH*> top, subtrees(1, root);
+            while (!subtrees.empty() && subtrees.size() < 4 * threads) {
+                std::vector<BVH*> next;
+                for (BVH* node : subtrees) {
+                    top.push_back(node);
+                    for (int c = 0; c < 2; c++)
+                        if (node->child_is_node(c)) next.push_back(node->child_node(c));
+                }
+                subtrees.swap(next);
+            }
+
+            std::atomic<std::size_t> nextSubtree(0);
+            auto worker = [&]() {
+                for (std::size_t i = nextSubtree++; i < subtrees.size(); i = nextSubtree++)
+                    optimizeSubtree(subtrees[i]);
+            };
+            std::vector<std::thread> pool;
+            for (unsigned t = 1; t < threads; t++)
+                pool.emplace_back(worker);
+            worker();
+            for (std::thread& thread : pool)
+                thread.join();
+
+            // deepest first, so children are done before their parents
+            for (auto node = top.rbegin(); node != top.rend(); ++node)
+                restructure(*node);
+        }
+
+        printf("Treelet restructuring: SAH cost %.2f -> %.2f (%d passes)\n", before / rootArea,
+            info.find(root)->second.cost / rootArea, passes);
+        info.clear();
+    }
+
+    /**
+     * Fills the info of every inner node from the current tree
+     *
+     * @param root root node of the BVH tree
+     *
+     */
+    void TreeletOptimizer::measure(BVH* root)
+    {
+        info.clear();
+        std::vector<BVH*> order;
+        std::vector<std::pair<BVH*, int>> pending(1, std::make_pair(root, 0));
+        while (!pending.empty()) {
+            BVH* node = pending.back().first;
+            int depth = pending.back().second;
+            pending.pop_back();
+
+            NodeInfo& node_info = info[node];
+            node_info.depth = depth;
+            order.push_back(node);
+            for (int c = 0; c < 2; c++)
+                if (node->child_is_node(c)) pending.push_back(std::make_pair(node->child_node(c), depth + 1));
+        }
+
+        for (auto node = order.rbegin(); node != order.rend(); ++node)
+            updateInfo(*node);
+    }
+
+    /**
+     * Restructures every node of a subtree, children before parents
+     *
+     * @param root root of the subtree
+     *
+     */
+    void TreeletOptimizer::optimizeSubtree(BVH* root)
+    {
+        std::vector<BVH*> order;
+        std::vector<BVH*> pending(1, root);
+        while (!pending.empty()) {
+            BVH* node = pending.back();
+            pending.pop_back();
+            order.push_back(node);
+            for (int c = 0; c < 2; c++)
+                if (node->child_is_node(c)) pending.push_back(node->child_node(c));
+        }
+
+        for (auto node = order.rbegin(); node != order.rend(); ++node)
+            restructure(*node);
+    }
+
+    /**
+     * Recomputes the cost and height of a node from its children
+     *
+     * @param node inner node whose children are up to date
+     *
+     */
+    void TreeletOptimizer::updateInfo(BVH* node)
+    {
+        NodeInfo& node_info = info.find(node)->second;
+
+        double cost = BVH_TRAVERSAL_COST * node->box.area();
+        int height = 0;
+        for (int c = 0; c < 2; c++) {
+            if (node->child_is_node(c)) {
+                const NodeInfo& child = info.find(node->child_node(c))->second;
+                cost += child.cost;
+                height = std::max(height, child.height);
+            }
+            else {
+                cost += BVH_INTERSECTION_COST * node->child_count(c) * node->box.area();
+            }
+        }
+        node_info.cost = cost;
+        node_info.height = height + 1;
+    }
+
+    /**
+     * Rebuilds the treelet rooted at node in its cheapest topology, if that is cheaper than the current one
+     *
+     * @param node treelet root, an inner node whose descendants are already processed
+     *
+     */
+    void TreeletOptimizer::restructure(BVH* node)
+    {
+        updateInfo(node);
+        if (node->has_single_child())
+            return;
+
+        // grow the treelet by opening its largest inner leaf
+        TreeletLeaf leaves[TREELET_LEAVES + 1];
+        BVH* internals[TREELET_LEAVES - 1];
+        int n_leaves = 0, n_internals = 0;
+
+        auto open = [&](BVH* parent) {
+            internals[n_internals++] = parent;
+            for (int c = 0; c < 2; c++) {
+                TreeletLeaf& leaf = leaves[n_leaves++];
+                if (parent->child_is_node(c)) {
+                    leaf.node = parent->child_node(c);
+                    leaf.run = nullptr;
+                    leaf.count = 0;
+                    leaf.box = leaf.node->box;
+                    leaf.cost = info.find(leaf.node)->second.cost;
+                    leaf.height = info.find(leaf.node)->second.height;
+                }
+                else {
+                    // a run only needs the part inside its node (spatial splits can share a shape between nodes)
+                    leaf.node = nullptr;
+                    leaf.run = parent->child_run(c);
+                    leaf.count = parent->child_count(c);
+                    leaf.box = aabb::empty();
+                    for (int k = 0; k < leaf.count; k++) {
+                        aabb shape_box;
+                        leaf.run[k].shape()->bounding_box(0, 0, shape_box);
+                        leaf.box.expand(shape_box);
+                    }
+                    leaf.box = intersect_boxes(leaf.box, parent->box);
+                    leaf.cost = 0;
+                    leaf.height = 0;
+                }
+            }
+        };
+
+        open(node);
+        while (n_leaves < TREELET_LEAVES) {
+            int largest = -1;
+            double largestArea = -1;
+            for (int i = 0; i < n_leaves; i++) {
+                if (leaves[i].node == nullptr || leaves[i].node->has_single_child()) continue;
+                double area = leaves[i].box.area();
+                if (area > largestArea) {
+                    largestArea = area;
+                    largest = i;
+                }
+            }
+            if (largest < 0)
+                break;
+
+            BVH* opened = leaves[largest].node;
+            leaves[largest] = leaves[--n_leaves];
+            open(opened);
+        }
+        if (n_leaves < 3)
+            return;
+
+        // cheapest topology of every subset of the leaves, smaller subsets first
+        const int subsets = 1 << n_leaves;
+        aabb box[1 << TREELET_LEAVES];
+        double cost[1 << TREELET_LEAVES];
+        int height[1 << TREELET_LEAVES];
+        unsigned split[1 << TREELET_LEAVES];
+
+        for (unsigned set = 1; set < (unsigned)subsets; set++) {
+            int first = lowestBit(set);
+            if (set == (1u << first)) {
+                box[set] = leaves[first].box;
+                cost[set] = leaves[first].cost;
+                height[set] = leaves[first].height;
+                continue;
+            }
+
+            box[set] = aabb::empty();
+            for (int i = 0; i < n_leaves; i++)
+                if (set & (1u << i)) box[set].expand(leaves[i].box);
+            double area = box[set].area();
+
+            // each partition once: the left part holds the lowest leaf
+            cost[set] = std::numeric_limits<double>::infinity();
+            unsigned rest = set & ~(1u << first);
+            for (unsigned sub = rest; ; sub = (sub - 1) & rest) {
+                unsigned left = sub | (1u << first);
+                unsigned right = set & ~left;
+                if (right != 0) {
+                    int primitives = 0;
+                    if ((left & (left - 1)) == 0) primitives += leaves[lowestBit(left)].count;
+                    if ((right & (right - 1)) == 0) primitives += leaves[lowestBit(right)].count;
+                    double c = cost[left] + cost[right] + area * (BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * primitives);
+                    if (c < cost[set]) {
+                        cost[set] = c;
+                        split[set] = left;
+                        height[set] = std::max(height[left], height[right]) + 1;
+                    }
+                }
+                if (sub == 0) break;
+            }
+        }
+
+        // keep the treelet unless the new one is cheaper and does not push the leaves too deep
+        const NodeInfo& current = info.find(node)->second;
+        unsigned all = subsets - 1;
+        if (cost[all] >= current.cost * (1 - 1e-6))
+            return;
+        if (height[all] > std::max(current.height, HEIGHT_LIMIT - current.depth))
+            return;
+
+        // rebuild top down, reusing the treelet's own inner nodes
+        std::pair<unsigned, BVH*> pending[TREELET_LEAVES];
+        int n_pending = 0, next_internal = 1;
+        pending[n_pending++] = std::make_pair(all, node);
+        while (n_pending > 0) {
+            unsigned set = pending[n_pending - 1].first;
+            BVH* target = pending[n_pending - 1].second;
+            n_pending--;
+
+            unsigned parts[2] = { split[set], set & ~split[set] };
+            for (int c = 0; c < 2; c++) {
+                if ((parts[c] & (parts[c] - 1)) == 0) {
+                    const TreeletLeaf& leaf = leaves[lowestBit(parts[c])];
+                    if (leaf.node != nullptr)
+                        target->set_child(c, leaf.node);
+                    else
+                        target->set_child(c, leaf.run, leaf.count);
+                }
+                else {
+                    BVH* inner = internals[next_internal++];
+                    pending[n_pending++] = std::make_pair(parts[c], inner);
+                    target->set_child(c, inner);
+                }
+            }
+            target->box = box[set];
+            target->axis = separatingAxis(box[parts[0]], box[parts[1]]);
+
+            NodeInfo& target_info = info.find(target)->second;
+            target_info.cost = cost[set];
+            target_info.height = height[set];
+        }
+    }
+
+} //namespace rt
@@ -0,0 +1,64 @@
+/*
+ * TreeletOptimizer.h
+ *
+ *
+ */
+
+#ifndef TREELETOPTIMIZER_H_
+#define TREELETOPTIMIZER_H_
+
+#include "core/Shape.h"
+#include "shapes/BVH.h"
+#include <unordered_map>
+#include <vector>
+
+namespace rt{
+
+/*
+ * BVH post-pass that restructures treelets for a lower SAH cost
+ * Source: Karras and Aila, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies", HPG 2013
+ *
+ * Bottom up, every inner node grows a treelet of up to TREELET_LEAVES leaves by repeatedly opening its
+ * largest inner leaf, then rebuilds the treelet in the topology of lowest SAH cost, found by dynamic
+ * programming over the subsets of its leaves. The treelet reuses its own nodes, so nothing is allocated.
+ * Disjoint subtrees are processed in parallel, then the nodes above them.
+ */
+class TreeletOptimizer {
+
+public:
+
+    //
+    // Constructor
+    //
+    TreeletOptimizer(int passes) : passes(passes) {};
+
+    //
+    // optimize function : restructures the tree under root in place
+    //
+    void optimize(BVH* root);
+
+private:
+
+    static const int TREELET_LEAVES = 7;
+
+    // SAH cost, height and depth of an inner node, depth as of the start of the pass
+    struct NodeInfo {
+        double cost;
+        int height;
+        int depth;
+    };
+
+    void measure(BVH* root);
+    void optimizeSubtree(BVH* root);
+    void restructure(BVH* node);
+    void updateInfo(BVH* node);
+
+    int passes;
+    std::unordered_map<const BVH*, NodeInfo> info; // one entry per inner node, filled before each pass
+};
+
+} //namespace rt
+
+
+
+#endif /* TREELETOPTIMIZER_H_ */
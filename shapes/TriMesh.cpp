@@ -5,9 +5,141 @@
  */
 #include "TriMesh.h"
 #include <algorithm> 
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 namespace rt{
 
+#ifdef __AVX2__
+namespace {
+
+    inline __m256 cross(const __m256 a[3], const __m256 b[3], int i) {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        return _mm256_fmsub_ps(a[j], b[k], _mm256_mul_ps(a[k], b[j]));
+    }
+
+    inline __m256 dot(const __m256 a[3], const __m256 b[3]) {
+        return _mm256_fmadd_ps(a[0], b[0], _mm256_fmadd_ps(a[1], b[1], _mm256_mul_ps(a[2], b[2])));
+    }
+
+    /*
+     * 8-wide Moller-Trumbore test of a ray against a block: returns the mask of the lanes hit within
+     * [t_min, t_max], with the distances and barycentrics of all lanes
+     */
+    inline __m256 intersectBlock(const TriangleBlock& block, const __m256 origin[3], const __m256 direction[3],
+        __m256 t_min, __m256 t_max, __m256& t, __m256& u, __m256& v) {
+        __m256 v0[3], e1[3], e2[3];
+        for (int a = 0; a < 3; a++) {
+            v0[a] = _mm256_loadu_ps(block.v0[a]);
+            e1[a] = _mm256_loadu_ps(block.e1[a]);
+            e2[a] = _mm256_loadu_ps(block.e2[a]);
+        }
+
+        __m256 pvec[3] = { cross(direction, e2, 0), cross(direction, e2, 1), cross(direction, e2, 2) };
+        __m256 det = dot(e1, pvec);
+        __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+        __m256 mask = _mm256_cmp_ps(absDet, _mm256_set1_ps(1e-12f), _CMP_GE_OQ);
+        __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+        __m256 tvec[3] = { _mm256_sub_ps(origin[0], v0[0]), _mm256_sub_ps(origin[1], v0[1]), _mm256_sub_ps(origin[2], v0[2]) };
+        u = _mm256_mul_ps(dot(tvec, pvec), invDet);
+        __m256 qvec[3] = { cross(tvec, e1, 0), cross(tvec, e1, 1), cross(tvec, e1, 2) };
+        v = _mm256_mul_ps(dot(direction, qvec), invDet);
+        t = _mm256_mul_ps(dot(e2, qvec), invDet);
+
+        __m256 zero = _mm256_setzero_ps();
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, t_min, _CMP_GE_OQ));
+        return _mm256_and_ps(mask, _mm256_cmp_ps(t, t_max, _CMP_LE_OQ));
+    }
+
+    /*
+     * 8-wide quad test (see QuadData): returns the mask of the lanes hit within [t_min, t_max], with the
+     * distances and edge coordinates of all lanes
+     */
+    inline __m256 intersectQuads(const QuadBlock& block, const __m256 origin[3], const __m256 direction[3],
+        __m256 t_min, __m256 t_max, __m256& t, __m256& a, __m256& b) {
+        __m256 normal[3], offset[3], dual1[3], dual3[3];
+        for (int i = 0; i < 3; i++) {
+            normal[i] = _mm256_loadu_ps(block.normal[i]);
+            offset[i] = _mm256_sub_ps(_mm256_loadu_ps(block.v0[i]), origin[i]);
+            dual1[i] = _mm256_loadu_ps(block.dual1[i]);
+            dual3[i] = _mm256_loadu_ps(block.dual3[i]);
+        }
+
+        __m256 denom = dot(normal, direction);
+        __m256 absDenom = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), denom);
+        __m256 mask = _mm256_cmp_ps(absDenom, _mm256_set1_ps(1e-8f), _CMP_GE_OQ);
+        t = _mm256_div_ps(dot(normal, offset), denom);
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, t_min, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, t_max, _CMP_LE_OQ));
+
+        __m256 local[3] = { _mm256_fmsub_ps(direction[0], t, offset[0]), _mm256_fmsub_ps(direction[1], t, offset[1]),
+            _mm256_fmsub_ps(direction[2], t, offset[2]) };
+        a = dot(local, dual1);
+        b = dot(local, dual3);
+
+        __m256 one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+        __m256 a2 = _mm256_loadu_ps(block.a2), b2 = _mm256_loadu_ps(block.b2);
+        __m256 edge1 = _mm256_fmsub_ps(_mm256_sub_ps(a2, one), b, _mm256_mul_ps(b2, _mm256_sub_ps(a, one)));
+        __m256 edge2 = _mm256_fmsub_ps(_mm256_sub_ps(b2, one), a, _mm256_fmsub_ps(a2, b, a2));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(a, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(b, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(edge1, zero, _CMP_GE_OQ));
+        return _mm256_and_ps(mask, _mm256_cmp_ps(edge2, zero, _CMP_GE_OQ));
+    }
+
+    // minimum of the 8 lanes, in every lane
+    inline __m256 horizontalMin(__m256 x) {
+        x = _mm256_min_ps(x, _mm256_permute2f128_ps(x, x, 1));
+        x = _mm256_min_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm256_min_ps(x, _mm256_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+    }
+
+    /*
+     * Lowers closest to the nearest hit lane of a block, if the block has any: returns that lane or -1
+     */
+    inline int closestLane(__m256 mask, __m256 t, __m256& closest) {
+        if (_mm256_movemask_ps(mask) == 0)
+            return -1;
+        __m256 hits = _mm256_blendv_ps(closest, t, mask);
+        closest = horizontalMin(hits);
+        int lanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(hits, closest, _CMP_EQ_OQ)));
+        int lane = 0;
+        while (!(lanes & (1 << lane))) lane++;
+        return lane;
+    }
+
+    inline float laneValue(__m256 x, int lane) {
+        float values[8];
+        _mm256_storeu_ps(values, x);
+        return values[lane];
+    }
+
+} // namespace
+#endif
+
+namespace {
+
+    /*
+     * A quad face is kept as a quad when its corners lie in one plane, up to the rounding of the mesh
+     * coordinates, and it is convex, which in the quad's edge coordinates puts v2 past the diagonal v1 v3
+     */
+    bool isPlanarConvexQuad(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const Vec3f& v3) {
+        QuadData quad(v0, v1, v2, v3);
+        float size = std::max((v1 - v0).length(), (v3 - v0).length());
+        if (!(size > 0) || !(std::fabs(quad.normal.dotProduct(v2 - v0)) <= 1e-5f * size))
+            return false;
+        return quad.a2 > 0 && quad.b2 > 0 && quad.a2 + quad.b2 > 1;
+    }
+
+} // namespace
+
     /**
      * Factory function that returns trimesh subclass based on trimesh specifications
      * @param nfaces the number of faces in a trimesh
@@ -29,12 +161,10 @@ namespace rt{
         std::unique_ptr<Vec3f[]>& normals,
         std::unique_ptr<Vec2f[]>& st,
         Material* material) :
-        numTris(0), material(material), Shape(material)
+        numTris(0), numQuads(0), material(material), Shape(material)
     {
         uint32_t k = 0, maxVertIndex = 0;
-        // find out how many triangles we need to create for this mesh
         for (uint32_t i = 0; i < nfaces; ++i) {
-            numTris += faceIndex[i] - 2;
             for (uint32_t j = 0; j < faceIndex[i]; ++j)
                 if (vertsIndex[k + j] > maxVertIndex)
                     maxVertIndex = vertsIndex[k + j];
@@ -44,18 +174,43 @@ namespace rt{
 
         // allocate memory to store the position of the mesh vertices
         P = std::unique_ptr<Vec3f[]>(new Vec3f[maxVertIndex]);
+        bounds = aabb::empty();
         for (uint32_t i = 0; i < maxVertIndex; ++i) {
             P[i] = verts[i];
+            bounds.expand(P[i]);
+        }
+
+        // find out which faces stay quads and how many triangles we need to create for the others
+        std::vector<bool> isQuad(nfaces);
+        k = 0;
+        for (uint32_t i = 0; i < nfaces; ++i) {
+            isQuad[i] = faceIndex[i] == 4 && isPlanarConvexQuad(P[vertsIndex[k]], P[vertsIndex[k + 1]], P[vertsIndex[k + 2]], P[vertsIndex[k + 3]]);
+            if (isQuad[i])
+                numQuads++;
+            else
+                numTris += faceIndex[i] - 2;
+            k += faceIndex[i];
         }
 
-        // allocate memory to store triangle indices
+        // allocate memory to store triangle and quad indices
         trisIndex = std::unique_ptr<uint32_t[]>(new uint32_t[numTris * 3]);
-        uint32_t l = 0;
+        quadsIndex = std::unique_ptr<uint32_t[]>(new uint32_t[numQuads * 4]);
+        uint32_t l = 0, q = 0;
 
-        // Generate the triangle index array
-        N = std::unique_ptr<Vec3f[]>(new Vec3f[numTris * 3]);
-        texCoordinates = std::unique_ptr<Vec2f[]>(new Vec2f[numTris * 3]);
+        // Generate the index arrays, fan triangulating the faces that are not quads
+        N = std::unique_ptr<Vec3f[]>(new Vec3f[numTris * 3 + numQuads * 4]);
+        texCoordinates = std::unique_ptr<Vec2f[]>(new Vec2f[numTris * 3 + numQuads * 4]);
         for (uint32_t i = 0, k = 0; i < nfaces; ++i) { // for each  face
+            if (isQuad[i]) {
+                for (uint32_t j = 0; j < 4; ++j) {
+                    quadsIndex[q + j] = vertsIndex[k + j];
+                    N[numTris * 3 + q + j] = normals[k + j];
+                    texCoordinates[numTris * 3 + q + j] = st[k + j];
+                }
+                q += 4;
+                k += faceIndex[i];
+                continue;
+            }
             for (uint32_t j = 0; j < faceIndex[i] - 2; ++j) { // for each triangle in the face
                 trisIndex[l] = vertsIndex[k];
                 trisIndex[l + 1] = vertsIndex[k + j + 1];
@@ -70,12 +225,186 @@ namespace rt{
             }
             k += faceIndex[i];
         }
+
+        // precompute the intersection data of every triangle and quad into blocks of 8 lanes
+        blocks.resize((numTris + TriangleBlock::WIDTH - 1) / TriangleBlock::WIDTH);
+        memset(blocks.data(), 0, blocks.size() * sizeof(TriangleBlock));
+        quadBlocks.resize((numQuads + QuadBlock::WIDTH - 1) / QuadBlock::WIDTH);
+        memset(quadBlocks.data(), 0, quadBlocks.size() * sizeof(QuadBlock));
+        faceNormals.resize(numTris + numQuads);
+        for (uint32_t i = 0; i < numTris; ++i) {
+            TriangleData tri(P[trisIndex[3 * i]], P[trisIndex[3 * i + 1]], P[trisIndex[3 * i + 2]]);
+            TriangleBlock& block = blocks[i / TriangleBlock::WIDTH];
+            int lane = i % TriangleBlock::WIDTH;
+            for (int a = 0; a < 3; a++) {
+                block.v0[a][lane] = tri.v0[a];
+                block.e1[a][lane] = tri.e1[a];
+                block.e2[a][lane] = tri.e2[a];
+            }
+            faceNormals[i] = tri.normal;
+        }
+        for (uint32_t i = 0; i < numQuads; ++i) {
+            QuadData quad(P[quadsIndex[4 * i]], P[quadsIndex[4 * i + 1]], P[quadsIndex[4 * i + 2]], P[quadsIndex[4 * i + 3]]);
+            QuadBlock& block = quadBlocks[i / QuadBlock::WIDTH];
+            int lane = i % QuadBlock::WIDTH;
+            for (int a = 0; a < 3; a++) {
+                block.v0[a][lane] = quad.v0[a];
+                block.normal[a][lane] = quad.normal[a];
+                block.dual1[a][lane] = quad.dual1[a];
+                block.dual3[a][lane] = quad.dual3[a];
+            }
+            block.a2[lane] = quad.a2;
+            block.b2[lane] = quad.b2;
+            faceNormals[numTris + i] = quad.normal;
+        }
     }
 
+    /**
+     * Finds the closest face hit, one block of triangles or quads at a time
+     *
+     * @param ray ray
+     * @param t_min min distance
+     * @param t_max max distance
+     * @param t distance of the closest hit
+     * @param u barycentric of the second vertex at the hit (of the fan triangle, for a quad)
+     * @param v barycentric of the third vertex at the hit
+     * @param index face index of the closest hit
+     *
+     * @return true if the ray hits a face within [t_min, t_max]
+     */
+    bool TriMesh::closestFace(const Ray& ray, float t_min, float t_max, float& t, float& u, float& v, uint32_t& index) const
+    {
+        bool found = false;
+#ifdef __AVX2__
+        __m256 origin[3], direction[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = _mm256_set1_ps(ray.origin[a]);
+            direction[a] = _mm256_set1_ps(ray.direction[a]);
+        }
+        __m256 lowest = _mm256_set1_ps(t_min);
+        __m256 closest = _mm256_set1_ps(t_max);
+
+        for (std::size_t b = 0; b < blocks.size(); ++b) {
+            __m256 bt, bu, bv;
+            __m256 mask = intersectBlock(blocks[b], origin, direction, lowest, closest, bt, bu, bv);
+            int lane = closestLane(mask, bt, closest);
+            if (lane < 0)
+                continue;
+            t = laneValue(bt, lane);
+            u = laneValue(bu, lane);
+            v = laneValue(bv, lane);
+            index = (uint32_t)(b * TriangleBlock::WIDTH + lane);
+            found = true;
+        }
 
-   
-    
+        // quads report the barycentrics of their fan triangles, computed for the closest one only
+        int quadLane = -1;
+        float quadA = 0, quadB = 0;
+        for (std::size_t b = 0; b < quadBlocks.size(); ++b) {
+            __m256 bt, ba, bb;
+            __m256 mask = intersectQuads(quadBlocks[b], origin, direction, lowest, closest, bt, ba, bb);
+            int lane = closestLane(mask, bt, closest);
+            if (lane < 0)
+                continue;
+            t = laneValue(bt, lane);
+            quadA = laneValue(ba, lane);
+            quadB = laneValue(bb, lane);
+            quadLane = (int)(b * QuadBlock::WIDTH + lane);
+            found = true;
+        }
+        if (quadLane >= 0) {
+            quadBlocks[quadLane / QuadBlock::WIDTH].lane(quadLane % QuadBlock::WIDTH).fanBarycentrics(quadA, quadB, u, v);
+            index = numTris + (uint32_t)quadLane;
+        }
+#else
+        for (std::size_t b = 0; b < blocks.size(); ++b) {
+            for (int lane = 0; lane < TriangleBlock::WIDTH; lane++) {
+                if (blocks[b].lane(lane).intersect(ray, t_min, t_max, t, u, v)) {
+                    t_max = t;
+                    index = (uint32_t)(b * TriangleBlock::WIDTH + lane);
+                    found = true;
+                }
+            }
+        }
+        float a, b, t_quad;
+        for (std::size_t k = 0; k < quadBlocks.size(); ++k) {
+            for (int lane = 0; lane < QuadBlock::WIDTH; lane++) {
+                QuadData quad = quadBlocks[k].lane(lane);
+                if (quad.intersect(ray, t_min, t_max, t_quad, a, b)) {
+                    t = t_max = t_quad;
+                    quad.fanBarycentrics(a, b, u, v);
+                    index = numTris + (uint32_t)(k * QuadBlock::WIDTH + lane);
+                    found = true;
+                }
+            }
+        }
+#endif
+        return found;
+    }
 
+    /**
+     * Adds the vertex positions of the faces, triangles then quads, to a hash
+     *
+     * @param h the hash
+     *
+     */
+    void TriMesh::hash(uint64_t& h) const
+    {
+        uint32_t counts[2] = { numTris, numQuads };
+        hash_bytes(h, counts, sizeof(counts));
+        for (uint32_t i = 0; i < 3 * numTris; ++i)
+            hash_bytes(h, &P[trisIndex[i]], sizeof(Vec3f));
+        for (uint32_t i = 0; i < 4 * numQuads; ++i)
+            hash_bytes(h, &P[quadsIndex[i]], sizeof(Vec3f));
+    }
+
+    /**
+     * Test the occlusion, stopping at the first block with a hit
+     *
+     * @param r shadow ray
+     * @param t_min min distance
+     * @param t_max max distance, usually the distance to the light
+     *
+     * @return true if any face hits the ray within [t_min, t_max]
+     */
+    bool TriMesh::occluded(const Ray& r, double t_min, double t_max) const
+    {
+#ifdef __AVX2__
+        __m256 origin[3], direction[3];
+        for (int a = 0; a < 3; a++) {
+            origin[a] = _mm256_set1_ps(r.origin[a]);
+            direction[a] = _mm256_set1_ps(r.direction[a]);
+        }
+        __m256 lowest = _mm256_set1_ps((float)t_min);
+        __m256 highest = _mm256_set1_ps((float)t_max);
+
+        for (const TriangleBlock& block : blocks) {
+            __m256 t, u, v;
+            if (_mm256_movemask_ps(intersectBlock(block, origin, direction, lowest, highest, t, u, v)) != 0)
+                return true;
+        }
+        for (const QuadBlock& block : quadBlocks) {
+            __m256 t, a, b;
+            if (_mm256_movemask_ps(intersectQuads(block, origin, direction, lowest, highest, t, a, b)) != 0)
+                return true;
+        }
+#else
+        float t, u, v;
+        for (const TriangleBlock& block : blocks) {
+            for (int lane = 0; lane < TriangleBlock::WIDTH; lane++) {
+                if (block.lane(lane).intersect(r, (float)t_min, (float)t_max, t, u, v))
+                    return true;
+            }
+        }
+        for (const QuadBlock& block : quadBlocks) {
+            for (int lane = 0; lane < QuadBlock::WIDTH; lane++) {
+                if (block.lane(lane).intersect(r, (float)t_min, (float)t_max, t, u, v))
+                    return true;
+            }
+        }
+#endif
+        return false;
+    }
 
 } //namespace rt
 
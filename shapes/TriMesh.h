@@ -11,13 +11,134 @@
 #include "core/RayHitStructs.h"
 #include "core/Shape.h"
 #include "shapes/Triangle.h"
-#include "BVH.h"
 #include <vector>
 #define _USE_MATH_DEFINES  // for MSVC, for M_PI
 #include <math.h>
 
 namespace rt{
 
+/*
+ * Eight mesh triangles in structure of arrays layout, one SIMD lane per triangle,
+ * so one 8-wide Moller-Trumbore evaluation tests a ray against all of them.
+ * Lanes past the last triangle have zero edges, which the test rejects as parallel.
+ */
+struct TriangleBlock {
+
+    static const int WIDTH = 8;
+
+    float v0[3][WIDTH];
+    float e1[3][WIDTH];     // v1 - v0
+    float e2[3][WIDTH];     // v2 - v0
+
+    //
+    // returns the triangle of a lane, for the scalar test
+    //
+    TriangleData lane(int i) const {
+        TriangleData tri;
+        tri.v0 = Vec3f(v0[0][i], v0[1][i], v0[2][i]);
+        tri.e1 = Vec3f(e1[0][i], e1[1][i], e1[2][i]);
+        tri.e2 = Vec3f(e2[0][i], e2[1][i], e2[2][i]);
+        return tri;
+    }
+};
+
+/*
+ * Planar convex quad (v0, v1, v2, v3) of a mesh, precomputed for the ray test.
+ * The ray meets the quad's plane and the hit point gets affine coordinates (a, b) along the edges v1 - v0 and
+ * v3 - v0 from their duals. In those coordinates the quad's corners are (0, 0), (1, 0), (a2, b2) and (0, 1),
+ * so the inside test is two signs and two edge functions.
+ */
+struct QuadData {
+
+    QuadData() {};
+    QuadData(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2, const Vec3f& v3) : v0(v0) {
+        Vec3f e1 = v1 - v0, e3 = v3 - v0;
+        Vec3f n = e1.crossProduct(e3);
+        float area2 = n.norm();
+        dual1 = e3.crossProduct(n) * (1 / area2);
+        dual3 = n.crossProduct(e1) * (1 / area2);
+        normal = n.normalize();
+        a2 = (v2 - v0).dotProduct(dual1);
+        b2 = (v2 - v0).dotProduct(dual3);
+    };
+
+    //
+    // returns true if the ray hits within [t_min, t_max], with the distance t and the edge coordinates a and b
+    //
+    inline bool intersect(const Ray& ray, float t_min, float t_max, float& t, float& a, float& b) const {
+        float denom = normal.dotProduct(ray.direction);
+
+        // ray parallel to the quad's plane
+        if (fabs(denom) < 1e-8f)
+            return false;
+
+        Vec3f offset = v0 - ray.origin;
+        t = normal.dotProduct(offset) / denom;
+        if (!(t >= t_min && t <= t_max))
+            return false;
+
+        Vec3f local = ray.direction * t - offset;
+        a = local.dotProduct(dual1);
+        b = local.dotProduct(dual3);
+        return a >= 0 && b >= 0 && (a2 - 1) * b - b2 * (a - 1) >= 0 && (b2 - 1) * a - a2 * b + a2 >= 0;
+    }
+
+    //
+    // barycentrics (u, v) of a hit at (a, b) in the fan triangle it falls in, (v0, v1, v2) or (v0, v2, v3),
+    // the same as the triangle test of that triangle would give
+    //
+    inline void fanBarycentrics(float a, float b, float& u, float& v) const {
+        if (a2 * b - b2 * a <= 0) {
+            v = b / b2;
+            u = a - v * a2;
+        }
+        else {
+            u = a / a2;
+            v = b - u * b2;
+        }
+    }
+
+    Vec3f v0;
+    Vec3f normal;   // unit length
+    Vec3f dual1;    // dual of v1 - v0: a point's coordinate along that edge
+    Vec3f dual3;    // dual of v3 - v0
+    float a2, b2;   // edge coordinates of v2
+};
+
+/*
+ * Eight mesh quads in structure of arrays layout, one SIMD lane per quad, like TriangleBlock.
+ * Lanes past the last quad have a zero normal, which the test rejects as parallel.
+ */
+struct QuadBlock {
+
+    static const int WIDTH = 8;
+
+    float v0[3][WIDTH];
+    float normal[3][WIDTH];
+    float dual1[3][WIDTH];
+    float dual3[3][WIDTH];
+    float a2[WIDTH];
+    float b2[WIDTH];
+
+    //
+    // returns the quad of a lane, for the scalar test
+    //
+    QuadData lane(int i) const {
+        QuadData quad;
+        quad.v0 = Vec3f(v0[0][i], v0[1][i], v0[2][i]);
+        quad.normal = Vec3f(normal[0][i], normal[1][i], normal[2][i]);
+        quad.dual1 = Vec3f(dual1[0][i], dual1[1][i], dual1[2][i]);
+        quad.dual3 = Vec3f(dual3[0][i], dual3[1][i], dual3[2][i]);
+        quad.a2 = a2[i];
+        quad.b2 = b2[i];
+        return quad;
+    }
+};
+
+/*
+ * Polygon mesh. Planar convex quads are kept as quads, other faces are fan triangulated.
+ * Faces are numbered triangles first, then quads: a hit's triIndex is numTris + q for quad q.
+ */
 class TriMesh: public Shape{
 
 public:
@@ -55,40 +176,72 @@ public:
     Hit intersect(Ray ray) const {
 
         Hit h;
-        uint32_t j = 0;
         h.hittable = false;
         h.distance = std::numeric_limits<float>::max();
-        for (uint32_t i = 0; i < numTris; ++i) {
-            const Vec3f& v0 = P[trisIndex[j]];
-            const Vec3f& v1 = P[trisIndex[j + 1]];
-            const Vec3f& v2 = P[trisIndex[j + 2]];
-            float t = std::numeric_limits<float>::max(), u, v;
-            Hit hitTri = triangleIntersect(ray, v0, v1, v2);
-            if (hitTri.hittable && hitTri.distance < h.distance) {
-                Vec3f hitPoint(ray.origin + ray.direction * hitTri.distance);
-                h.point = hitPoint.normalize();
-                h.distance = hitTri.distance;
-                h.uv = hitTri.uv;
-                h.normal = hitTri.normal;
-                h.triIndex = i;
-                h.hittable = true;
-            }
-            j += 3;
+
+        float t, u, v;
+        uint32_t i;
+        if (closestFace(ray, 0, h.distance, t, u, v, i)) {
+            Vec3f hitPoint(ray.origin + ray.direction * t);
+            h.point = hitPoint.normalize();
+            h.distance = t;
+            h.uv = Vec2f(u, v);
+            h.normal = faceNormals[i];
+            h.triIndex = i;
+            h.object = this;
+            h.hittable = true;
         }
         return h;
     };
 
-    // to be implemented for BVH
+    //
+    // Occlusion test for shadow rays: stops at the first block with a hit
+    //
+    bool occluded(const Ray& r, double t_min, double t_max) const;
+
+    //
+    // Closest face hit within [t_min, t_max]: its distance, barycentrics (in the fan triangle of a quad) and face index
+    //
+    bool closestFace(const Ray& ray, float t_min, float t_max, float& t, float& u, float& v, uint32_t& index) const;
+
+    //
+    // Closest hit test: records the distance, face and barycentrics, fill_hit adds the surface attributes
+    //
     bool hit(
         const Ray& r, double t_min, double t_max, Hit& rec) const {
-
+        float t, u, v;
+        uint32_t i;
+        if (!closestFace(r, (float)t_min, (float)t_max, t, u, v, i)) {
+            rec.hittable = false;
+            return false;
+        }
+        rec.distance = t;
+        rec.u = u;
+        rec.v = v;
+        rec.triIndex = i;
+        rec.object = this;
+        rec.hittable = true;
         return true;
     }
 
+    void fill_hit(const Ray& r, Hit& rec) const {
+        Vec3f hitPoint(r.origin + r.direction * rec.distance);
+        rec.point = hitPoint.normalize();
+        rec.uv = Vec2f(rec.u, rec.v);
+        rec.normal = faceNormals[rec.triIndex];
+        rec.material = material;
+    }
+
     bool bounding_box(double time0, double time1, aabb& output_box) const {
+        output_box = bounds;
         return true;
     }
 
+    //
+    // Hashes the vertex positions of every face
+    //
+    void hash(uint64_t& h) const;
+
     /**
      * Computes U and V reflection vectors to map texture image pixels on sphere.
      * Source: https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/barycentric-coordinates.html,
@@ -104,113 +257,20 @@ public:
         return hit.uv;
     }
 
-    /**
-     * Computes whether a ray hit the specific instance of a triangle shape and returns the hit data
-     *
-     * @param ray cast ray to check for intersection with shape
-     * @param v0, v1, v2 triangle vertices
-     *
-     * @return hit struct containing intersection information
-     *
-     */
-    Hit triangleIntersect(Ray ray, Vec3f v0, Vec3f v1, Vec3f v2) const{
-        Hit h;
-
-        // compute the plane's normal
-        Vec3f v0v1 = v1 - v0;
-        Vec3f v0v2 = v2 - v0;
-        // no need to normalize
-        Vec3f N = (v0v1.crossProduct(v0v2)).normalize(); // N
-        float denom = N.dotProduct(N);
-
-        Vec3f pvec =ray.direction.crossProduct(v0v2);
-        float det = v0v1.dotProduct(pvec);
-
-        // Step 1: finding P
-
-        // check if the ray and plane are parallel.
-        float NdotRayDirection = N.dotProduct(ray.direction);
-        if (fabs(NdotRayDirection) < 1e-8) {  // they are parallel 
-            h.hittable = false;
-            return h;
-        }
-
-        // compute UV 
-        float invDet = 1 / det;
-        Vec3f tvec = ray.origin - v0;
-        float u = tvec.dotProduct(pvec) * invDet;
-        Vec3f qvec = tvec.crossProduct(v0v1);
-        float v = ray.direction.dotProduct(qvec) * invDet;
-        h.uv = Vec2f(u, v);
-
-        // compute d parameter 
-        float d = -N.dotProduct(v0);
-
-        // compute t, distance from ray origin to intersection 
-        float t = -(N.dotProduct(ray.origin) + d) / NdotRayDirection;
-        // check if the triangle is behind the ray
-        if (t < 0) {
-            h.hittable = false;
-            return h;
-        }
-
-        // compute the intersection point 
-        Vec3f P = ray.origin + t * ray.direction;
-
-        // Step 2: inside-outside test
-        Vec3f C; // vector perpendicular to triangle's plane
-
-        // edge 0
-        Vec3f edge0 = v1 - v0;
-        Vec3f vp0 = P - v0;
-        C = edge0.crossProduct(vp0);
-        if (N.dotProduct(C) < 0) {
-            // P is on the right side
-            h.hittable = false;
-            return h;
-        }
-
-        // edge 1
-        Vec3f edge1 = v2 - v1;
-        Vec3f vp1 = P - v1;
-        C = edge1.crossProduct(vp1);
-        if ((N.dotProduct(C)) < 0) {
-            // P is on the right side
-            h.hittable = false;
-            return h;
-        }
-
-        // edge 2
-        Vec3f edge2 = v0 - v2;
-        Vec3f vp2 = P - v2;
-        C = edge2.crossProduct(vp2);
-        if ((N.dotProduct(C)) < 0) {
-            // P is on the right side
-            h.hittable = false;
-            return h;
-        }
-
-        // this ray hits the triangle: store hit elements    
-        h.distance = t;
-        Vec3f hitPoint(ray.origin + ray.direction * t);
-        hitPoint = hitPoint.normalize();
-        h.point = hitPoint;
-        h.normal = N;
-        h.hittable = true;
-        
-        return h;
-    };	
-
-
-
     //
     // Trimesh members
     //
     uint32_t numTris;                        // number of triangles
-    std::unique_ptr<uint32_t[]> trisIndex;   // vertex index array
-    std::unique_ptr<Vec3f[]> P;              // triangles vertex position
-    std::unique_ptr<Vec2f[]> texCoordinates; // triangles texture coordinates
-    std::unique_ptr<Vec3f[]> N;              // triangles vertex normals
+    uint32_t numQuads;                       // number of quads
+    std::unique_ptr<uint32_t[]> trisIndex;   // vertex index array, 3 per triangle
+    std::unique_ptr<uint32_t[]> quadsIndex;  // vertex index array, 4 per quad
+    std::unique_ptr<Vec3f[]> P;              // vertex position
+    std::unique_ptr<Vec2f[]> texCoordinates; // face corner texture coordinates, triangles then quads
+    std::unique_ptr<Vec3f[]> N;              // face corner vertex normals, triangles then quads
+    std::vector<TriangleBlock> blocks;       // triangle i in lane i % 8 of block i / 8
+    std::vector<QuadBlock> quadBlocks;       // quad q in lane q % 8 of block q / 8
+    std::vector<Vec3f> faceNormals;          // unit normal per face, triangles then quads
+    aabb bounds;
     
 
 
@@ -10,10 +10,55 @@
 #include "math/geometry.h"
 #include "core/RayHitStructs.h"
 #include "core/Shape.h"
-#include "BVH.h"
+#include <limits>
 
 namespace rt{
 
+/*
+ * Triangle with its first vertex, edges and normal precomputed for the ray test
+ * Source: Moller and Trumbore, "Fast, Minimum Storage Ray/Triangle Intersection", JGT 1997
+ *
+ * The test solves for the distance and the barycentrics (u, v) of v1 and v2 directly, so a hit needs no
+ * inside-outside test and no triangle areas for its UVs.
+ */
+struct TriangleData {
+
+    TriangleData() {};
+    TriangleData(const Vec3f& v0, const Vec3f& v1, const Vec3f& v2) : v0(v0), e1(v1 - v0), e2(v2 - v0) {
+        normal = e1.crossProduct(e2).normalize();
+    };
+
+    //
+    // returns true if the ray hits within [t_min, t_max], with the distance t and the barycentrics u and v
+    //
+    inline bool intersect(const Ray& ray, float t_min, float t_max, float& t, float& u, float& v) const {
+        Vec3f pvec = ray.direction.crossProduct(e2);
+        float det = e1.dotProduct(pvec);
+
+        // ray parallel to the triangle's plane
+        if (fabs(det) < 1e-12f)
+            return false;
+
+        float invDet = 1 / det;
+        Vec3f tvec = ray.origin - v0;
+        u = tvec.dotProduct(pvec) * invDet;
+        if (u < 0 || u > 1)
+            return false;
+
+        Vec3f qvec = tvec.crossProduct(e1);
+        v = ray.direction.dotProduct(qvec) * invDet;
+        if (v < 0 || u + v > 1)
+            return false;
+
+        t = e2.dotProduct(qvec) * invDet;
+        return t >= t_min && t <= t_max;
+    }
+
+    Vec3f v0;
+    Vec3f e1, e2;   // v1 - v0 and v2 - v0
+    Vec3f normal;   // unit length
+};
+
 class Triangle: public Shape{
 
 public:
@@ -22,44 +67,35 @@ public:
 	// Constructors and destructor
 	//
 	Triangle() {};
-	Triangle(Vec3f v0, Vec3f v1, Vec3f v2, std::string type, Material* material) :v0(v0), v1(v1), v2(v2), type(type), material(material), Shape(material) {};
+	Triangle(Vec3f v0, Vec3f v1, Vec3f v2, std::string type, Material* material) :v0(v0), v1(v1), v2(v2), data(v0, v1, v2), type(type), material(material), Shape(material) {};
 
 	virtual ~Triangle() {};
 
     /**
-     * Computes U and V reflection vectors to map texture image pixels on sphere.
+     * Returns the UV coordinates of a hit, set from its barycentrics by the intersection test.
      * Source: https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/barycentric-coordinates.html,
      * UV mapping the primitives (page.23).
      *
-     * @param pos the hit position (x and y coordinates)
+     * @param hit the hit record
      *
-     * @return pos the mapped hit postion
+     * @return the mapped hit position
      *
      */
     Vec2f getUV(const Hit hit) const {
-        //barycentric interpolation
-        float totalArea = getTriangleArea(v0, v1, v2);
-        float u = getTriangleArea(v1, v2, hit.point) / totalArea;
-        float v = getTriangleArea(v0, hit.point, v2) / totalArea;
-        float w = getTriangleArea(v0, v1, hit.point) / totalArea;
-
-        // nearest neighbor
-        Vec2f P = u * Vec2f(0, 1) + v * Vec2f(1, 1) + w * Vec2f(1, 0);
-        if (P.x > 1.0f) {
-            P.x = 1.0f;
-        }
-        if (P.y > 1.0f) {
-            P.y = 1.0f;
-        }
-        return P;
+        return hit.uv;
     }
-    
 
-    float getTriangleArea(Vec3f a, Vec3f b, Vec3f c) const
-    {
-        Vec3f ab = b - a;
-        Vec3f ac = c - a;
-        return ab.crossProduct(ac).length() / 2.0f;
+    /**
+     * Maps the barycentrics of a hit to texture coordinates: v0 at (0, 1), v1 at (1, 1) and v2 at (1, 0)
+     *
+     * @param u barycentric of v1
+     * @param v barycentric of v2
+     *
+     * @return the UV coordinates
+     *
+     */
+    static Vec2f barycentricUV(float u, float v) {
+        return Vec2f(u + v, 1 - v);
     }
 
 	//
@@ -67,76 +103,23 @@ public:
 	//
     Hit intersect(Ray ray) const {
         Hit h;
-
-        // compute the triangle's normal
-        Vec3f v0v1 = v1 - v0;
-        Vec3f v0v2 = v2 - v0;
-        // no need to normalize
-        Vec3f N = (v0v1.crossProduct(v0v2)).normalize(); // N
-        float denom = N.dotProduct(N);
-
-        // Step 1: finding P
-
-        // check if the ray and plane are parallel.
-        float NdotRayDirection = N.dotProduct(ray.direction);
-        if (fabs(NdotRayDirection) < 1e-8) {  // they are parallel 
+        float t, u, v;
+        if (!data.intersect(ray, 0, std::numeric_limits<float>::max(), t, u, v)) {
             h.hittable = false;
             return h;
         }
 
-        // compute d parameter using equation 2
-        float d = -N.dotProduct(v0);
-
-        // compute t, distance from ray origin to intersection (equation 3)
-        float t = -(N.dotProduct(ray.origin) + d) / NdotRayDirection;
-        // check if the triangle is behind the ray
-        if (t < 0) {   
-            h.hittable = false;
-            return h;
-        }
-
-        // compute the intersection point using equation 1
-        Vec3f P = ray.origin + t * ray.direction;
-
-        // Step 2: inside-outside test
-        Vec3f C; // vector perpendicular to triangle's plane
-
-        // edge 0
-        Vec3f edge0 = v1 - v0;
-        Vec3f vp0 = P - v0;
-        C = edge0.crossProduct(vp0);
-        if (N.dotProduct(C) < 0) {
-            h.hittable = false; // P is on the right side
-            return h;
-        }
-
-        // edge 1
-        Vec3f edge1 = v2 - v1;
-        Vec3f vp1 = P - v1;
-        C = edge1.crossProduct(vp1);
-        if ((N.dotProduct(C)) < 0) {
-            h.hittable = false; // P is on the right side
-            return h;
-        }
-
-        // edge 2
-        Vec3f edge2 = v0 - v2;
-        Vec3f vp2 = P - v2;
-        C = edge2.crossProduct(vp2);
-        if ((N.dotProduct(C)) < 0) {
-            h.hittable = false; // P is on the right side
-            return h;
-        }
-
         // this ray hits the triangle: store hit elements
         h.distance = t;
         Vec3f hitPoint(ray.origin + ray.direction * h.distance);
         hitPoint = hitPoint.normalize();
         h.point = hitPoint;
-        h.shape = std::string("triangle");
-
+        h.object = this;
+        h.u = u;
+        h.v = v;
+        h.uv = barycentricUV(u, v);
         h.hittable = true;
-        h.normal = N;
+        h.normal = data.normal;
 
         return h;
 	};
@@ -145,86 +128,64 @@ public:
         return type;
     }
 
+    PrimitiveKind getKind() const {
+        return TRIANGLE_PRIMITIVE;
+    }
+
+    void hash(uint64_t& h) const {
+        Vec3f v[3] = { v0, v1, v2 };
+        hash_bytes(h, v, sizeof(v));
+    }
+
 
     //
     // Intersection test function for BVH version: returns true if ray hits any object, false otherwise
     //
     bool hit(
         const Ray& ray, double t_min, double t_max, Hit& h) const {
-
-        // compute the triangle's normal
-        Vec3f v0v1 = v1 - v0;
-        Vec3f v0v2 = v2 - v0;
-        // no need to normalize
-        Vec3f N = (v0v1.crossProduct(v0v2)).normalize(); // N
-        float denom = N.dotProduct(N);
-
-        // Step 1: finding P
-
-        // check if the ray and plane are parallel.
-        float NdotRayDirection = N.dotProduct(ray.direction);
-        if (fabs(NdotRayDirection) < 1e-8) {  // they are parallel 
+        float t, u, v;
+        if (!data.intersect(ray, t_min, t_max, t, u, v)) {
             h.hittable = false;
             return false;
         }
 
-        // compute d parameter using equation 2
-        float d = -N.dotProduct(v0);
-
-        // compute t, distance from ray origin to intersection (equation 3)
-        float t = -(N.dotProduct(ray.origin) + d) / NdotRayDirection;
-        // check if the triangle is behind the ray
-        if (t < 0) {
-            h.hittable = false;
-            return false;
-        }
-
-        // compute the intersection point using equation 1
-        Vec3f P = ray.origin + t * ray.direction;
-
-        // Step 2: inside-outside test
-        Vec3f C; // vector perpendicular to triangle's plane
-
-        // edge 0
-        Vec3f edge0 = v1 - v0;
-        Vec3f vp0 = P - v0;
-        C = edge0.crossProduct(vp0);
-        if (N.dotProduct(C) < 0) {
-            h.hittable = false; // P is on the right side
-            return false;
-        }
-
-        // edge 1
-        Vec3f edge1 = v2 - v1;
-        Vec3f vp1 = P - v1;
-        C = edge1.crossProduct(vp1);
-        if ((N.dotProduct(C)) < 0) {
-            h.hittable = false; // P is on the right side
-            return false;
-        }
-
-        // edge 2
-        Vec3f edge2 = v0 - v2;
-        Vec3f vp2 = P - v2;
-        C = edge2.crossProduct(vp2);
-        if ((N.dotProduct(C)) < 0) {
-            h.hittable = false; // P is on the right side
-            return false;
-        }
-
         // this ray hits the triangle: store hit elements
         h.distance = t;
+        h.object = this;
+        h.u = u;
+        h.v = v;
+        h.hittable = true;
+
+        return true;
+    }
+
+    //
+    // Surface attributes of a hit found by hit()
+    //
+    void fill_hit(const Ray& ray, Hit& h) const {
         Vec3f hitPoint(ray.origin + ray.direction * h.distance);
         hitPoint = hitPoint.normalize();
         h.point = hitPoint;
-        h.shape = std::string("triangle");
-        h.set_face_normal(ray, N);
+        h.set_face_normal(ray, data.normal);
         h.material = material;
-        h.uv = getUV(h);
-        h.hittable = true;
-        h.normal = N;
+        h.uv = barycentricUV(h.u, h.v);
+        h.normal = data.normal;
+    }
 
-        return true;
+    //
+    // Occlusion test for shadow rays: no normal or UV bookkeeping
+    //
+    bool occluded(const Ray& ray, double t_min, double t_max) const {
+        float t, u, v;
+        return data.intersect(ray, t_min, t_max, t, u, v);
+    }
+
+    //
+    // Clip the triangle against a split plane for the spatial split builder
+    //
+    void split_bounding_box(int axis, float pos, aabb& left_box, aabb& right_box) const {
+        Vec3f v[3] = { v0, v1, v2 };
+        split_polygon_box(v, 3, axis, pos, left_box, right_box);
     }
 
     //
@@ -263,6 +224,7 @@ public:
 private:
     std::string type;
 	Vec3f v0, v1, v2;
+    TriangleData data;
     Material* material;
     
 };
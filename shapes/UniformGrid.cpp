@@ -0,0 +1,224 @@
+/*
+ * UniformGrid.cpp
+ *
+ *
+ */
+#include "UniformGrid.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace rt{
+
+namespace {
+
+    int clampCell(int cell, int resolution) {
+        return std::min(std::max(cell, 0), resolution - 1);
+    }
+
+    // axis of the nearest cell boundary
+    int nextAxis(const float next[3]) {
+        if (next[0] < next[1])
+            return next[0] < next[2] ? 0 : 2;
+        return next[1] < next[2] ? 1 : 2;
+    }
+
+} // namespace
+
+    const int UniformGrid::MAX_RESOLUTION;
+
+    /**
+     * Constructor that bins the shapes by their bounding boxes.
+     * The longest axis gets 3 * cbrt(N) cells and the others keep the cells roughly cubic.
+     *
+     * @param shapes the scene shapes
+     *
+     */
+    UniformGrid::UniformGrid(const std::vector<Shape*>& shapes)
+    {
+        std::vector<aabb> boxes(shapes.size());
+        bounds = aabb::empty();
+        primitives.reserve(shapes.size());
+        for (std::size_t i = 0; i < shapes.size(); ++i) {
+            primitives.push_back(PrimitiveRef(shapes[i]));
+            shapes[i]->bounding_box(0, 0, boxes[i]);
+            bounds.expand(boxes[i]);
+        }
+
+        float maxExtent = 0;
+        for (int a = 0; a < 3; a++)
+            maxExtent = std::max(maxExtent, bounds.maximum[a] - bounds.minimum[a]);
+        float cellsPerUnit = maxExtent > 0 ? 3.0f * std::cbrt((float)shapes.size()) / maxExtent : 0;
+
+        for (int a = 0; a < 3; a++) {
+            float extent = bounds.maximum[a] - bounds.minimum[a];
+            resolution[a] = std::min(std::max((int)std::round(extent * cellsPerUnit), 1), MAX_RESOLUTION);
+            cellSize[a] = extent / resolution[a];
+            invCellSize[a] = extent > 0 ? resolution[a] / extent : 0;
+        }
+
+        // cells overlapped by a box, inclusive
+        auto cellRange = [this](const aabb& box, int lo[3], int hi[3]) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = clampCell((int)((box.minimum[a] - bounds.minimum[a]) * invCellSize[a]), resolution[a]);
+                hi[a] = clampCell((int)((box.maximum[a] - bounds.minimum[a]) * invCellSize[a]), resolution[a]);
+            }
+        };
+
+        // count the shapes of every cell, then fill the cells in place
+        std::size_t numCells = (std::size_t)resolution[0] * resolution[1] * resolution[2];
+        cellStart.assign(numCells + 1, 0);
+        int lo[3], hi[3], cell[3];
+        for (const aabb& box : boxes) {
+            cellRange(box, lo, hi);
+            for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+                for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+                    for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+                        cellStart[cellIndex(cell) + 1]++;
+        }
+        for (std::size_t i = 0; i < numCells; ++i)
+            cellStart[i + 1] += cellStart[i];
+
+        cellShapes.resize(cellStart[numCells]);
+        std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+        for (std::size_t i = 0; i < boxes.size(); ++i) {
+            cellRange(boxes[i], lo, hi);
+            for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+                for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+                    for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+                        cellShapes[fill[cellIndex(cell)]++] = (uint32_t)i;
+        }
+    }
+
+    /**
+     * Finds the cell where the ray enters the grid and sets up the walk from there
+     *
+     * @param r ray
+     * @param t_min min distance
+     * @param t_max max distance
+     * @param walk the walk state
+     *
+     * @return false if the ray misses the grid within [t_min, t_max]
+     */
+    bool UniformGrid::startWalk(const Ray& r, double t_min, double t_max, Walk& walk) const
+    {
+        float t_entry;
+        if (!bounds.hit(r, t_min, t_max, t_entry))
+            return false;
+
+        for (int a = 0; a < 3; a++) {
+            float entry = r.origin[a] + r.direction[a] * t_entry;
+            int cell = clampCell((int)((entry - bounds.minimum[a]) * invCellSize[a]), resolution[a]);
+            walk.cell[a] = cell;
+
+            if (r.direction[a] > 0) {
+                walk.step[a] = 1;
+                walk.out[a] = resolution[a];
+                walk.next[a] = (bounds.minimum[a] + (cell + 1) * cellSize[a] - r.origin[a]) * r.invDirection[a];
+                walk.delta[a] = cellSize[a] * r.invDirection[a];
+            }
+            else if (r.direction[a] < 0) {
+                walk.step[a] = -1;
+                walk.out[a] = -1;
+                walk.next[a] = (bounds.minimum[a] + cell * cellSize[a] - r.origin[a]) * r.invDirection[a];
+                walk.delta[a] = -cellSize[a] * r.invDirection[a];
+            }
+            else {
+                walk.step[a] = 0;
+                walk.out[a] = -1;
+                walk.next[a] = std::numeric_limits<float>::infinity();
+                walk.delta[a] = std::numeric_limits<float>::infinity();
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Test the intersection, cell by cell along the ray
+     *
+     * @param r ray
+     * @param t_min min distance
+     * @param t_max max distance
+     * @param rec hit records
+     *
+     * @return true if ray hits the shape, false otherwise
+     */
+    bool UniformGrid::hit(const Ray& r, double t_min, double t_max, Hit& rec) const
+    {
+        Walk walk;
+        if (!startWalk(r, t_min, t_max, walk))
+            return false;
+
+        uint32_t mailbox[MAILBOX_SIZE] = { 0 };
+        bool hit_anything = false;
+        float closest = t_max;
+
+        while (true) {
+            int cell = cellIndex(walk.cell);
+            for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; ++k) {
+                uint32_t index = cellShapes[k];
+                uint32_t& slot = mailbox[index % MAILBOX_SIZE];
+                if (slot == index + 1)
+                    continue;
+                slot = index + 1;
+
+                if (primitive_hit(primitives[index], r, t_min, closest, rec)) {
+                    hit_anything = true;
+                    closest = rec.distance;
+                }
+            }
+
+            // a hit inside this cell is closer than anything in the cells ahead
+            int axis = nextAxis(walk.next);
+            if (walk.next[axis] >= closest)
+                return hit_anything;
+
+            walk.cell[axis] += walk.step[axis];
+            if (walk.cell[axis] == walk.out[axis])
+                return hit_anything;
+            walk.next[axis] += walk.delta[axis];
+        }
+    }
+
+    /**
+     * Test the occlusion, stopping at the first hit
+     *
+     * @param r shadow ray
+     * @param t_min min distance
+     * @param t_max max distance, usually the distance to the light
+     *
+     * @return true if any shape hits the ray within [t_min, t_max]
+     */
+    bool UniformGrid::occluded(const Ray& r, double t_min, double t_max) const
+    {
+        Walk walk;
+        if (!startWalk(r, t_min, t_max, walk))
+            return false;
+
+        uint32_t mailbox[MAILBOX_SIZE] = { 0 };
+
+        while (true) {
+            int cell = cellIndex(walk.cell);
+            for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; ++k) {
+                uint32_t index = cellShapes[k];
+                uint32_t& slot = mailbox[index % MAILBOX_SIZE];
+                if (slot == index + 1)
+                    continue;
+                slot = index + 1;
+
+                if (primitive_occluded(primitives[index], r, t_min, t_max))
+                    return true;
+            }
+
+            int axis = nextAxis(walk.next);
+            if (walk.next[axis] > t_max)
+                return false;
+
+            walk.cell[axis] += walk.step[axis];
+            if (walk.cell[axis] == walk.out[axis])
+                return false;
+            walk.next[axis] += walk.delta[axis];
+        }
+    }
+
+} //namespace rt
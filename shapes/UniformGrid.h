@@ -0,0 +1,103 @@
+/*
+ * UniformGrid.h
+ *
+ *
+ */
+
+#ifndef UNIFORMGRID_H_
+#define UNIFORMGRID_H_
+
+#include "core/Shape.h"
+#include "core/RayHitStructs.h"
+#include "shapes/Primitive.h"
+#include <cstdint>
+#include <vector>
+
+namespace rt{
+
+/*
+ * Uniform grid accelerator, an alternative to the BVH for evenly distributed scenes
+ * Source: Amanatides and Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing", Eurographics 1987
+ *
+ * Every shape is listed in each cell its bounding box overlaps. A ray walks the cells it pierces in order
+ * (3D-DDA) and stops at the first cell that contains its closest hit. A shape spanning several cells is
+ * tested once per ray thanks to a small mailbox kept on the stack of the query.
+ */
+class UniformGrid :public Shape {
+
+public:
+
+    //
+    // Constructors : bins the shapes into a grid sized from their count
+    //
+    UniformGrid(const std::vector<Shape*>& shapes);
+
+    virtual ~UniformGrid() {};
+
+    Hit intersect(Ray ray) const {
+        Hit h;
+        return h;
+    }
+
+    Vec2f getUV(const Hit hit) const {
+        return Vec2f(0, 0);
+    }
+
+    std::string getType() const {
+        return std::string("UniformGrid");
+    }
+
+    bool hit(const Ray& r, double t_min, double t_max, Hit& rec) const;
+
+    bool occluded(const Ray& r, double t_min, double t_max) const;
+
+    bool bounding_box(double time0, double time1, aabb& output_box) const {
+        output_box = bounds;
+        return true;
+    }
+
+    //
+    // Getters
+    //
+    int getResolution(int axis) const {
+        return resolution[axis];
+    }
+
+    std::size_t getReferenceCount() const {
+        return cellShapes.size();
+    }
+
+private:
+
+    static const int MAX_RESOLUTION = 128;  // cells per axis
+    static const int MAILBOX_SIZE = 64;     // direct-mapped, a collision only costs a repeated test
+
+    // cell walk state of one ray
+    struct Walk {
+        int cell[3];
+        int step[3];
+        int out[3];         // cell index past the grid along the walk
+        float next[3];      // distance to the next cell boundary per axis
+        float delta[3];     // distance between cell boundaries per axis
+    };
+
+    bool startWalk(const Ray& r, double t_min, double t_max, Walk& walk) const;
+
+    int cellIndex(const int cell[3]) const {
+        return (cell[2] * resolution[1] + cell[1]) * resolution[0] + cell[0];
+    }
+
+    aabb bounds;
+    int resolution[3];
+    Vec3f cellSize;
+    Vec3f invCellSize;
+    std::vector<PrimitiveRef> primitives;   // the shapes in scene order
+    std::vector<uint32_t> cellStart;    // shapes of cell i are cellShapes[cellStart[i] .. cellStart[i + 1])
+    std::vector<uint32_t> cellShapes;   // shape indices
+};
+
+} //namespace rt
+
+
+
+#endif /* UNIFORMGRID_H_ */